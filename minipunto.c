@@ -14,22 +14,68 @@
 # include <unistd.h>
 # include <stdlib.h>
 # include <X11/Xutil.h>
+# include <X11/extensions/XShm.h>
 # include <X11/keysymdef.h>
 # include <math.h>
 # include <string.h>
+# include <stdint.h>
+# include <limits.h>
+# include <ctype.h>
+# include <time.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/ipc.h>
+# include <sys/shm.h>
+# include <pthread.h>
+# include <signal.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <sys/uio.h>
+# include <sys/select.h>
+# include <poll.h>
 
 /*** Program parameters ***/
 # define VERSION "0.2" /* Program version */
 # define WIDTH 600 /* Width of window in pixels */
 # define HEIGHT 600 /* Height of window in pixels */
 # define BACKGROUND_COLOUR 0 /* Default background colour */
-# define BACKGROUND_HORIZON
 # define TEXT_COLOUR 0x00FF00 /* Default text colour */
+# define TEXT_BLOCK (1 << 20) /* Size of blocks read from data files */
+# define QUEUE_DEPTH 3 /* Default number of frames read ahead */
+# define FOLLOW_WAIT 50 /* Milliseconds to wait for live data (and to parse it at once) */
+# define FOLLOW_FRAMES 1024 /* Newest frames of live data kept in the index and cache */
+# define KEYFRAME_INTERVAL 16 /* Frames per keyframe in delta-encoded files */
+# define TILE 64 /* Size in pixels of the screen tiles drawn by each thread */
+# define BLOCK 8 /* Size in pixels of the occlusion buffer blocks (dividing TILE) */
+# define PIXELSUM_MAX 8191 /* Particles averaged per pixel when merging (255*8191 < 2^21) */
+# define PROFILE_MAX 128 /* Largest disc radius with a stored lighting profile */
+# define VIDEO_BUFFERS 4 /* Number of frames waiting to be written to video */
+# define BENCH_FRAMES 60 /* Camera positions on the benchmark path */
+# define BAND_SAMPLES (1 << 24) /* Samples drawn at once when supersampling */
+# define FAR_PLANE 2.5f /* Depth of the background in camera distances */
+# define BOND_RADIUS 0.3f /* Radius of bonds relative to the smaller of their particles */
+# define GRID_MIN 65536 /* Smallest frame indexed in a culling grid */
+# define GRID_OCCUPANCY 64 /* Average number of particles per grid cell */
 
 // # define FAST_MATH /* Sloppy but possibly faster math */
 // # define RAW_VIDEO_TO_FILE /* Output raw video to file (instead of sending it to avconv) */
 // # define NO_FADING /* Do not dim lights as particles move away from the camera */
-// # define BACKGROUND_HORIZON if(j > HEIGHT/2) XPutPixel(I, i, j, 0x007700); else /* Background horizon */
+// # define NO_MMAP /* Read data files in blocks instead of mapping them into memory */
+// # define NO_SIMD /* Shade pixels one by one instead of with SSE2/AVX2 */
+// # define HORIZON_COLOUR 0x007700 /* Background below the horizon */
+
+/* Default video encoder (or "raw" for a raw video file) */
+# ifdef RAW_VIDEO_TO_FILE
+# define ENCODER "raw"
+# else
+# define ENCODER "avconv"
+# endif
+
+/* SSE2 and AVX2 span kernels (chosen at run time) */
+# if (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+# define SIMD
+# include <immintrin.h>
+# endif
 
 /*** Macros ***/
 # define vector(x, y, z) (float[3]){(x), (y), (z)}
@@ -43,155 +89,4222 @@
 # define CYAN   "\x1B[36m"
 # define BLUE   "\x1B[34m"
 
-/*** Unicode special characters ***/
-# define ULINE  "\xe2\x94\x80"
+/*** Unicode special characters ***/
+# define ULINE  "\xe2\x94\x80"
+
+/*** Key codes ***/
+/* Check key codes with xmodmap -pk */
+# define KEY_PLUS  XK_plus
+# define KEY_MINUS XK_minus
+# define KEY_LEFT  XK_Left
+# define KEY_RIGHT XK_Right
+# define KEY_UP    XK_Up
+# define KEY_DOWN  XK_Down
+# define KEY_Q     XK_Q
+# define KEY_q     XK_q
+# define KEY_ESC   XK_Escape
+# define KEY_W     XK_W
+# define KEY_w     XK_w
+# define KEY_A     XK_A
+# define KEY_a     XK_a
+# define KEY_B     XK_B
+# define KEY_b     XK_b
+# define KEY_S     XK_S
+# define KEY_s     XK_s
+# define KEY_D     XK_D
+# define KEY_d     XK_d
+# define KEY_Z     XK_Z
+# define KEY_z     XK_z
+# define KEY_X     XK_X
+# define KEY_x     XK_x
+# define KEY_R     XK_R
+# define KEY_r     XK_r
+# define KEY_F     XK_F
+# define KEY_f     XK_f
+# define KEY_1     XK_1
+# define KEY_2     XK_2
+# define KEY_3     XK_3
+# define KEY_4     XK_4
+# define KEY_P     XK_P
+# define KEY_p     XK_p
+# define KEY_SPC   XK_space
+# define KEY_C     XK_C
+# define KEY_c     XK_c
+# define KEY_O     XK_O
+# define KEY_o     XK_o
+# define KEY_0     XK_0
+# define KEY_I     XK_I
+# define KEY_i     XK_i
+# define KEY_LBRACKET XK_bracketleft
+# define KEY_RBRACKET XK_bracketright
+
+/*** Mathematical vector functions ***/
+/* Dot product */
+static __inline__ float dot(float u[3], float v[3]) {
+  int i; /* Index */
+  float prod = 0; /* Scalar product */
+
+  for(i = 0; i < 3; i++)
+    prod += u[i]*v[i];
+
+  return prod;
+}
+
+/* Cross product */
+static __inline__ void cross(float u[3], float v[3], float uxv[3]) {
+  float x, y, z;
+
+  x = u[1]*v[2] - u[2]*v[1];
+  y = u[2]*v[0] - u[0]*v[2];
+  z = u[0]*v[1] - u[1]*v[0];
+
+  uxv[0] = x;
+  uxv[1] = y;
+  uxv[2] = z;
+
+  return;
+}
+
+/* Modulus of a vector */
+static __inline__ float modulus(float v[3]) {
+  return sqrt(dot(v, v));
+}
+
+/* Rotate a vector by a given angle around an axis */
+static __inline__ void rotate(float v[3], float axis[3], float angle) {
+  int i; /* Index */
+  float rot[3]; /* Rotation */
+  float length1, length2; /* Length of a vector */
+
+  length1 = angle/modulus(axis);
+  for(i = 0; i < 3; i++) rot[i] = length1*axis[i];
+  length1 = modulus(v);
+  cross(v, rot, rot);
+  for(i = 0; i < 3; i++) v[i] += rot[i];
+  length2 = modulus(v);
+  for(i = 0; i < 3; i++) v[i] *= length1/length2;
+}
+
+/*** Data types ***/
+
+/* Boolean type */
+typedef enum {false = 0, true} bool;
+
+/* Camera data type */
+struct camera {
+  float location[3];  /* Location */
+  float aim[3];       /* Point to look at */
+  float distance;     /* Distance from aim */
+  float direction[3]; /* Direction unit vector */
+  float screenx[3], screeny[3]; /* Direction of the screen x and y axes */
+};
+
+/* RGB colour */
+struct colour {
+  int r;
+  int g;
+  int b;
+};
+
+/* Frame of particle data (stored as a struct of arrays) */
+struct frame {
+  int n;               /* Number of particles */
+  int size;            /* Number of particles allocated */
+  float * x, * y, * z; /* Particle positions */
+  float * R;           /* Particle radii */
+  int * c;             /* Particle RGB colours */
+  bool newmsg;         /* The frame sets a new on-screen message */
+  char msg[250];       /* On-screen message */
+  bool newcamera;      /* The frame contains a camera command */
+  float camera[9];     /* Camera location, aim and zenith */
+  int nbonds;          /* Number of bonds */
+  int bondsize;        /* Number of bonds allocated */
+  int * bonds;         /* Pairs of bonded particles (numbered from 0 in the frame) */
+  double readtime;     /* Time spent reading the frame (in seconds) */
+};
+
+/* Block reader for ASCII data files */
+struct textreader {
+  FILE * file;         /* Data file (NULL if the text is already in memory) */
+  char * buf;          /* Text buffer */
+  size_t size;         /* Size of the buffer */
+  size_t start, end;   /* Unread data in the buffer */
+  long offset;         /* Position in the file of the beginning of the buffer */
+  bool eof;            /* No more data in the file */
+  bool mapped;         /* The buffer is the whole file mapped into memory */
+  bool follow;         /* Wait for more data at the end of the file (live data) */
+  long keep;           /* Position kept in the buffer while following (frame start) */
+};
+
+/* Binary trajectory (.mpb) file header. The file holds, in native byte order,
+   - the header,
+   - the radii and colours, if they are the same in every frame,
+   - the frames: number of particles and frame flags, message, camera command,
+     bonds (number of bonds and pairs of particles), positions (x, y and z
+     arrays of floats or quantized int16 values), and radii and colours
+     (unless they are in the header),
+   - the frame index: position in the file and number of particles of every
+     frame. */
+struct binheader {
+  char magic[4];       /* "MPB1" */
+  int flags;           /* Quantized positions, constant radii and colours */
+  int nframes;         /* Number of frames */
+  int n;               /* Number of particles (for constant radii and colours) */
+  long long index;     /* Position of the frame index in the file */
+  float offset[3];     /* Minimum coordinates (for quantized positions) */
+  float scale[3];      /* Quantization steps (for quantized positions) */
+};
+
+/* Binary trajectory flags */
+# define BIN_INT16   1 /* Positions quantized to 16 bits */
+# define BIN_RADII   2 /* Constant radii stored after the header */
+# define BIN_COLOURS 4 /* Constant colours stored after the header */
+
+/* Keyframe of the delta-encoded frames in a binary trajectory or the frame
+   cache. Frames are stored as the differences between their stored values
+   (int16 or float bits of the positions, radii and colours) and those of
+   the keyframe, as variable-length integers (with runs of unchanged values
+   in a single code). */
+struct keyframe {
+  bool loaded;         /* A keyframe is held */
+  long pos;            /* Position of the keyframe in the file */
+  int n;               /* Number of particles in it */
+  int count;           /* Frames written against it (including itself) */
+  int m, size;         /* Number of stored values, values allocated */
+  uint32_t * v, * w;   /* Stored values of the keyframe and of another frame */
+  unsigned char * bytes; /* Encoded differences */
+};
+
+/* Trajectory (data file, frame index and binary frame cache) */
+struct trajectory {
+  struct textreader text; /* ASCII data file */
+  FILE * binary;       /* Binary trajectory file (NULL for ASCII data) */
+  struct binheader bin; /* Binary trajectory header */
+  float * binR;        /* Constant radii in a binary trajectory */
+  int * binc;          /* Constant colours in a binary trajectory */
+  FILE * cache;        /* Binary frame cache (NULL if disabled) */
+  int nframes;         /* Number of frames read (the index ends with the last one) */
+  int first;           /* Number of the first frame in the index (older frames of
+                          live data are dropped) */
+  int size;            /* Number of index entries allocated */
+  long * textpos;      /* Byte offset of each frame in the data file */
+  long * cachepos;     /* Byte offset of each frame in the cache (or binary file) */
+  int * nparticles;    /* Number of particles in each frame */
+  long textend;        /* Byte offset of the end of the last indexed frame */
+  bool complete;       /* The whole data file has been indexed */
+  float cutoff;        /* Distance below which particles are bonded, in frames
+                          without bonds of their own (0 for none) */
+  bool delta;          /* Delta-encode the frames in the cache */
+  struct keyframe key; /* Keyframe read last (from the binary file or cache) */
+  struct keyframe cachekey; /* Keyframe written last to the cache */
+};
+
+/* Frame flags in binary trajectories and the frame cache */
+# define FRAME_MSG    1 /* Frame sets an on-screen message */
+# define FRAME_CAMERA 2 /* Frame contains a camera command */
+# define FRAME_BONDS  4 /* Frame contains bonds */
+# define FRAME_DELTA  8 /* Frame stored as differences from a keyframe */
+
+/* Frame pipeline (reader thread feeding a ring buffer of frames) */
+struct pipeline {
+  struct trajectory * traj; /* Trajectory read by the reader thread */
+  struct frame * slots; /* Ring buffer of frames */
+  int * number;        /* Frame number of each slot */
+  int depth;           /* Number of slots */
+  int head, count;     /* First full slot, number of full slots */
+  int next;            /* Number of the next frame to read */
+  int step;            /* Frames to advance after each one read */
+  int generation;      /* Number of seeks (frames read before a seek are dropped) */
+  bool loop;           /* Go back to the first frame after the last one */
+  bool end;            /* The last frame has been read (without looping) */
+  bool quit;           /* Stop the reader thread */
+  pthread_t thread;    /* Reader thread */
+  pthread_mutex_t lock; /* Lock on the pipeline */
+  pthread_cond_t notfull, notempty; /* Space in the queue, frames in the queue */
+};
+
+/* Coarse uniform grid of the particles in a frame, to cull whole cells */
+struct grid {
+  int n;               /* Particles in the grid (0 if there is no grid) */
+  int side;            /* Cells along each axis */
+  float lo[3];         /* Lower corner */
+  float cell[3];       /* Cell size */
+  float reach;         /* Distance from a cell centre to its corners */
+  float * rmax;        /* Largest particle radius in each cell */
+  int * start;         /* First particle of each cell */
+  struct frame sorted; /* Particles sorted by cell (in file order within a cell) */
+  int * index;         /* Cell of each particle */
+  int ncells;          /* Number of cells */
+  int maxcells, size;  /* Cells and particles allocated */
+};
+
+/* Cell list of the particles in a frame, to find neighbours within a cutoff */
+struct celllist {
+  int side[3];         /* Cells along each axis */
+  int * start;         /* First particle of each cell */
+  int * cell;          /* Cell of each particle */
+  int * index;         /* Particles sorted by cell */
+  float * pos;         /* Positions of the sorted particles (x, y and z of each) */
+  int ncells, size;    /* Cells and particles allocated */
+};
+
+/* Bond projected on the screen */
+struct segment {
+  float x[2], y[2];    /* Screen coordinates of the ends (particle centres) */
+  float depth[2];      /* Depths of the ends */
+  float size;          /* Half width in pixels times depth */
+  int c[2];            /* RGB colours of the two halves */
+};
+
+/* Sub-pixel particles merged on a pixel (16 bytes, so that a pixel is
+   read and written in a single cache line) */
+struct pixelsum {
+  int n;               /* Number of particles */
+  float depth;         /* Depth of the nearest one */
+  uint64_t rgb;        /* Sums of the colour components of the first
+                          PIXELSUM_MAX of them, in 21-bit fields */
+};
+
+/* Particles projected on the screen */
+struct projection {
+  int n;               /* Number of projected particles */
+  int size;            /* Number of particles allocated */
+  int * xs, * ys, * s; /* Screen coordinates and radius in pixels */
+  float * depth;       /* Depth of particle measured from camera */
+  int * c;             /* RGB colour */
+  struct grid grid;    /* Grid of the frame (if it stays on screen) */
+  uint32_t * keys;     /* Depth sort keys (two buffers) */
+  int * order;         /* Depth sort permutation (two buffers) */
+  int sortsize;        /* Number of particles allocated for sorting */
+  bool sorted;         /* The particles are sorted front to back */
+  float aggregate;     /* Particles per pixel above which sub-pixel particles are
+                          merged (0 to draw them one by one) */
+  struct pixelsum * sums; /* Merged sub-pixel particles on each pixel */
+  int sumwidth, sumheight; /* Size of the screen in the sums */
+  int merged;          /* Number of particles merged */
+  int nbonds;          /* Number of projected bonds */
+  int bondsize;        /* Number of bonds allocated */
+  struct segment * bonds; /* Projected bonds */
+};
+
+/* Profile of a frame: time spent in each stage (in seconds) and drawing counts */
+struct stats {
+  int frame;           /* Frame number */
+  int particles;       /* Particles in the frame */
+  int drawn;           /* Particles in view */
+  long tested, visible; /* Depth tests, pixels passing them */
+  long discs, occluded; /* Discs (or their parts in a tile), those skipped as hidden */
+  int skipped;         /* Trajectory frames skipped since the last one */
+  float playback;      /* Trajectory frames played per second */
+  double read;         /* Reading the frame (in the reader thread) */
+  double wait;         /* Waiting for the frame and handling events */
+  double project, draw; /* Projecting and drawing particles */
+  double present;      /* Sending the image to X */
+  double capture;      /* Queueing screenshots and video frames */
+  double clear;        /* Clearing the image and z-buffer */
+  double total;        /* Whole frame */
+};
+
+/* Lighting profile of a disc of a given radius in pixels */
+struct profile {
+  int * w;             /* Half width of each row (row j at |j|) */
+  float ** row;        /* Light angle factors across each row (centred) */
+};
+
+/* Rasteriser (image, z-buffer and worker threads drawing screen tiles) */
+struct raster {
+  XImage * I;          /* X image updated from the pixels (NULL if not needed) */
+  uint32_t * pixels;   /* 32-bit RGB pixels */
+  uint32_t * copy;     /* Pixels copied into the X image (NULL if not needed) */
+  int stride;          /* Pixels per image row */
+  float * zbuffer;     /* Pixel depth z-buffer */
+  int width, height;   /* Size of the image */
+  int top;             /* Screen row of the first image row (0 unless drawing a band) */
+  int fade;            /* Fading flag */
+  float backdrop;      /* Maximum allowed depth */
+  struct projection * p; /* Particles being drawn */
+  long tested, visible; /* Depth tests in the last frame, pixels passing them */
+  bool occlusion;      /* Draw front to back, skipping discs already hidden */
+  long discs, occluded; /* Discs in the last frame, those skipped as hidden */
+  int nbx, nby;        /* Number of occlusion blocks across and down the screen */
+  float * blockmax;    /* Upper bound of the depths in each block */
+  float * tilemax;     /* Upper bound of the depths in each tile */
+  char * blockstale, * tilestale; /* Drawn since the bound was computed */
+  struct profile * profiles[PROFILE_MAX + 1]; /* Lighting profiles by radius */
+  int (* shade)(float *, uint32_t *, const float *, int, float, float, const float *); /* Span kernel */
+  const char * kernel; /* Name of the span kernel */
+  int nthreads;        /* Number of threads drawing (including the main one) */
+  pthread_t * workers; /* Worker threads */
+  int ntx, nty;        /* Number of tiles across and down the screen */
+  int * tilestart;     /* Beginning of the list of particles of each tile */
+  int * tilelist;      /* Particles overlapping each tile (in file order), then
+                          bonds (numbered after the particles) */
+  int listsize;        /* Number of list entries allocated */
+  void (* task)(void *, int); /* Task handed to the workers (drawing a tile or
+                          filtering a row of samples) */
+  void * arg;          /* Argument of the task */
+  int ntasks;          /* Number of tasks */
+  int nexttask;        /* Next task to run */
+  int job;             /* Number of jobs handed to the workers */
+  int busy;            /* Number of workers still running tasks */
+  pthread_mutex_t lock; /* Lock on the job counters */
+  pthread_cond_t start, done; /* New job, workers finished */
+};
+
+/* Supersampler (an image drawn n x n times larger, in bands of sample rows
+   that are filtered down into the image by the threads of the raster) */
+struct supersampler {
+  struct raster r;     /* Rasteriser of a band of samples */
+  struct raster * image; /* Image (its raster is only used for the pixels) */
+  int n;               /* Samples per pixel across */
+  int band;            /* Image rows per band */
+  int y0, y1;          /* Image rows of the band being filtered */
+  int lo, hi;          /* Sample offsets covered by the filter of a pixel */
+  float * weight;      /* Filter weight of each offset (from lo) */
+  uint32_t * pixels;   /* Samples of a band */
+  float * zbuffer;     /* Z-buffer of a band */
+};
+
+/* Frame writer for video, screenshots and frame dumps (pool of frame buffers
+   written by a separate thread) */
+struct recorder {
+  int format;          /* Output format */
+  FILE * file;         /* Output file or encoder pipe (NULL for one file per frame) */
+  char * pattern;      /* Name pattern of the frame files */
+  bool pipe;           /* The file is an encoder pipe (opened with popen) */
+  bool splice;         /* Pages are handed to the pipe with vmsplice */
+  bool lossless;       /* Wait for a free buffer instead of dropping frames */
+  bool failed;         /* The file or encoder stopped accepting frames */
+  int width, height;   /* Frame size */
+  uint32_t ** buffers; /* Pool of frame buffers */
+  int * number;        /* Frame number in each buffer */
+  int nbuffers;        /* Number of buffers */
+  unsigned char * encoded; /* Encoded image */
+  unsigned char * filtered; /* Filtered rows of a png image */
+  int head, count;     /* First full buffer, number of full buffers */
+  int kept;            /* Written buffers the pipe may still be reading (0 or 1) */
+  int written, dropped, peak; /* Frames written and dropped, longest queue */
+  bool quit;           /* Stop the writer thread once the queue is empty */
+  pthread_t thread;    /* Writer thread */
+  pthread_mutex_t lock; /* Lock on the queue */
+  pthread_cond_t notempty, notfull; /* Frames in the queue, free buffers */
+};
+
+/* Frame writer output formats */
+# define OUTPUT_RAW 0  /* Raw native-endian 32-bit pixels (rgb32 video) */
+# define OUTPUT_PPM 1  /* Binary ppm images */
+# define OUTPUT_PNG 2  /* Png images */
+
+/* Window images (MIT-SHM images shown in turns, or a single plain image) */
+struct screen {
+  Display * d;         /* X display */
+  Window w;            /* Window */
+  GC g;                /* Graphics context */
+  int width, height;   /* Size of the images */
+  XImage * image[2];   /* Images */
+  int nimages;         /* Number of images */
+  int back;            /* Image being drawn */
+  bool shm;            /* Images in shared memory with the X server */
+  XShmSegmentInfo shminfo[2]; /* Shared memory segments */
+  bool pending[2];     /* The X server has not finished reading the image */
+  int completion;      /* Type of the ShmCompletion event */
+};
+
+/* Synthetic system for benchmarks */
+struct synthetic {
+  int kind;            /* Lattice, gas or droplet */
+  long n;              /* Number of particles */
+  float rmin, rmax;    /* Range of radii (default radii if rmax <= 0) */
+  int side;            /* Lattice sites along each side */
+  float spacing;       /* Lattice spacing */
+  float size;          /* Half size of the box, or droplet radius */
+  uint64_t seed;       /* State of the random number generator */
+};
+
+/* Synthetic systems */
+# define SYSTEM_LATTICE 0 /* Rock salt lattice, as in examples/NaCl.dat */
+# define SYSTEM_GAS 1     /* Random gas (5% volume fraction) */
+# define SYSTEM_DROPLET 2 /* Dense spherical droplet (50% volume fraction) */
+
+/*** Auxiliary functions ***/
+
+/* Set up camera position and orientation */
+void setcamera(struct camera * cam, float location[3], float aim[3], float zenith[3])
+{
+  int i; /* Coordinate index */
+  float r; /* Vector modulus */
+
+  for(i = 0; i < 3; i++) cam->location[i] = location[i];
+  for(i = 0; i < 3; i++) cam->aim[i] = aim[i];
+  for(i = 0; i < 3; i++) cam->direction[i] = aim[i] - location[i];
+
+  /* Normalise direction vector */
+  cam->distance = modulus(cam->direction);
+  if(cam->distance == 0)
+    cam->direction[0] = -1;
+  else
+    for(i = 0; i < 3; i++) cam->direction[i] /= cam->distance;
+
+  /* Screen axes */
+  cross(cam->direction, zenith, cam->screenx);
+  if(modulus(cam->screenx) == 0) cam->screenx[1] = 1;
+  cross(cam->screenx, cam->direction, cam->screeny);
+
+  /* Resize screen axes */
+  r = modulus(cam->screenx);
+  for(i = 0; i < 3; i++) cam->screenx[i] /= r;
+  r = modulus(cam->screeny);
+  for(i = 0; i < 3; i++) cam->screeny[i] /= r;
+}
+
+/* Keep the view (camera and fade flag) last drawn; true if it has changed */
+bool setview(float view[10], float location[3], float aim[3], float zenith[3], int fade)
+{
+  int i; /* Coordinate index */
+  bool changed = (view[9] != fade); /* The view has changed */
+
+  for(i = 0; i < 3; i++) {
+    changed = changed || view[i] != location[i] || view[3 + i] != aim[i]
+                      || view[6 + i] != zenith[i];
+    view[i] = location[i];
+    view[3 + i] = aim[i];
+    view[6 + i] = zenith[i];
+  }
+  view[9] = fade;
+
+  return changed;
+}
+
+/* Time in seconds from a monotonic clock */
+double seconds(void)
+{
+  struct timespec ts; /* Clock time */
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/* Time in seconds since *t, which is moved to the present */
+static __inline__ double lap(double * t)
+{
+  double t0 = *t; /* Previous time */
+
+  *t = seconds();
+  return *t - t0;
+}
+
+/* Allocate memory aligned to 64 bytes (a cache line, and enough for any SIMD
+   load), or return NULL */
+void * alignedalloc(size_t size)
+{
+  void * p; /* Memory block */
+
+  if(posix_memalign(&p, 64, size)) return NULL;
+  return p;
+}
+
+/*** Frame input ***/
+
+/* Make room for at least n particles in a frame */
+void growframe(struct frame * f, int n)
+{
+  if(n <= f->size) return;
+
+  f->size = (2*f->size > n)?2*f->size:n;
+  f->x = realloc(f->x, f->size*sizeof(float));
+  f->y = realloc(f->y, f->size*sizeof(float));
+  f->z = realloc(f->z, f->size*sizeof(float));
+  f->R = realloc(f->R, f->size*sizeof(float));
+  f->c = realloc(f->c, f->size*sizeof(int));
+
+  if(!f->x || !f->y || !f->z || !f->R || !f->c) {
+    fprintf(stderr, "Error: unable to allocate memory for %d particles.\n", n);
+    exit(-1);
+  }
+}
+
+/* Make room for n bonds in a frame */
+void growbonds(struct frame * f, int n)
+{
+  if(n <= f->bondsize) return;
+
+  f->bondsize = (2*f->bondsize > n)?2*f->bondsize:n;
+  f->bonds = realloc(f->bonds, 2*f->bondsize*sizeof(int));
+  if(f->bonds == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for %d bonds.\n", n);
+    exit(-1);
+  }
+}
+
+/* Set up the reader for a data file (mapped into memory if it is a regular file,
+   or read without blocking if it is followed as it grows) */
+void opentext(struct textreader * t, FILE * file, bool follow)
+{
+  struct stat st; /* File status */
+  void * map; /* Memory map of the file */
+
+  t->file = file;
+  t->offset = ftell(file);
+  t->buf = NULL;
+  t->size = t->start = t->end = 0;
+  t->eof = t->mapped = false;
+  t->follow = follow;
+  t->keep = -1;
+  if(follow) fcntl(fileno(file), F_SETFL, fcntl(fileno(file), F_GETFL) | O_NONBLOCK);
+
+  # ifndef NO_MMAP
+  if(!follow && !fstat(fileno(file), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if(map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      t->buf = map;
+      t->size = t->end = st.st_size;
+      t->start = (t->offset > 0)?t->offset:0;
+      t->offset = 0;
+      t->eof = t->mapped = true;
+    }
+  }
+  # endif
+}
+
+/* Ask the kernel to read ahead part of a mapped data file in the background */
+void prefetchtext(struct textreader * t, long pos, long length)
+{
+  static long page = 0; /* Page size */
+
+  if(!t->mapped || length <= 0 || pos >= (long) t->size) return;
+  if(page == 0) page = sysconf(_SC_PAGESIZE);
+
+  length += pos%page;
+  pos -= pos%page;
+  if(pos + length > (long) t->size) length = t->size - pos;
+
+  madvise(t->buf + pos, length, MADV_WILLNEED);
+}
+
+/* Fill the text buffer, keeping the unread data (false if nothing new was read) */
+bool filltext(struct textreader * t)
+{
+  size_t n; /* Number of bytes read */
+  size_t from = t->start; /* First byte to keep */
+  ssize_t r; /* Result of read */
+  struct stat st; /* File status */
+
+  if(t->eof) return false;
+
+  /* Move the unread data (and, while following, the frame being read) to the
+     beginning of the buffer */
+  if(t->follow && t->keep >= t->offset && t->keep - t->offset < (long) from)
+    from = t->keep - t->offset;
+  if(from > 0) {
+    memmove(t->buf, t->buf + from, t->end - from);
+    t->offset += from;
+    t->end -= from;
+    t->start -= from;
+  }
+
+  /* Make room for lines longer than the buffer */
+  if(t->end == t->size) {
+    t->size = t->size?2*t->size:TEXT_BLOCK;
+    t->buf = realloc(t->buf, t->size);
+    if(t->buf == NULL) {
+      fprintf(stderr, "Error: unable to allocate memory for the text buffer.\n");
+      exit(-1);
+    }
+  }
+
+  if(t->follow) { /* Live data: take what has arrived so far */
+    r = read(fileno(t->file), t->buf + t->end, t->size - t->end);
+    if(r > 0) t->end += r;
+    else if(r == 0) /* A pipe closed by the writer (a regular file may still grow) */
+      t->eof = !fstat(fileno(t->file), &st) && !S_ISREG(st.st_mode);
+    else if(errno != EAGAIN && errno != EINTR) t->eof = true;
+    return (r > 0);
+  }
+
+  n = fread(t->buf + t->end, 1, t->size - t->end, t->file);
+  if(n == 0) t->eof = true;
+  t->end += n;
+
+  return (n > 0);
+}
+
+/* Wait until more live data arrives, for at most FOLLOW_WAIT milliseconds */
+void waittext(struct textreader * t)
+{
+  struct pollfd pfd = {fileno(t->file), POLLIN, 0}; /* Data file */
+  struct stat st; /* File status */
+
+  if(!fstat(pfd.fd, &st) && S_ISREG(st.st_mode))
+    usleep(1000*FOLLOW_WAIT); /* Regular files are always readable */
+  else poll(&pfd, 1, FOLLOW_WAIT);
+}
+
+/* Next line in the text buffer (NULL at the end of the file) */
+char * nextline(struct textreader * t, char ** eol)
+{
+  char * line; /* Beginning of the line */
+  char * nl; /* Newline character */
+
+  if(t->start == t->end && !filltext(t)) return NULL;
+
+  for(;;) {
+    line = t->buf + t->start;
+    nl = memchr(line, '\n', t->end - t->start);
+    if(nl) {
+      *eol = nl;
+      t->start = nl + 1 - t->buf;
+      return line;
+    }
+    if(!filltext(t)) { /* Last line without a newline */
+      if(t->follow && !t->eof) return NULL; /* The rest of the line is still to come */
+      line = t->buf + t->start;
+      *eol = t->buf + t->end;
+      t->start = t->end;
+      return line;
+    }
+  }
+}
+
+/* Position in the data file of the next unread byte */
+long telltext(struct textreader * t)
+{
+  return t->offset + t->start;
+}
+
+/* Move to a position in the data file (false on failure) */
+bool seektext(struct textreader * t, long pos)
+{
+  /* The position is already in the buffer */
+  if(pos >= t->offset && pos <= t->offset + (long) t->end) {
+    t->start = pos - t->offset;
+    return true;
+  }
+
+  if(t->file == NULL || fseek(t->file, pos, SEEK_SET)) return false;
+  t->offset = pos;
+  t->start = t->end = 0;
+  t->eof = false;
+  return true;
+}
+
+/* Parse a number with strtof (returns the number of characters used) */
+int strtofloat(const char * s, const char * end, float * x)
+{
+  char token[64]; /* Copy of the number */
+  char * tokenend; /* End of the number */
+  int n = (end - s < 63)?end - s:63; /* Length of the copy */
+
+  memcpy(token, s, n);
+  token[n] = '\0';
+  *x = strtof(token, &tokenend);
+
+  return tokenend - token;
+}
+
+/* Parse a number (returns the number of characters used, 0 if there is none).
+   Faster than strtof for the usual decimal notation, which it handles on its
+   own; anything unusual (hexadecimal, inf, nan) is passed on to strtof. */
+int parsefloat(const char * s, const char * end, float * x)
+{
+  static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char * p = s; /* Current character */
+  const char * digits; /* First digit */
+  unsigned long long mantissa = 0; /* Decimal digits */
+  int ndigits = 0; /* Number of significant digits */
+  int exponent = 0; /* Decimal exponent */
+  int e = 0, esign = 1; /* Explicit exponent */
+  bool negative = false; /* Sign */
+  double value; /* Result */
+
+  if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+  digits = p;
+
+  /* Integer part */
+  for(; p < end && *p >= '0' && *p <= '9'; p++) {
+    if(ndigits < 19) {mantissa = 10*mantissa + (*p - '0'); if(mantissa) ndigits++;}
+    else exponent++;
+  }
+  /* Fractional part */
+  if(p < end && *p == '.') {
+    for(p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      if(ndigits < 19) {mantissa = 10*mantissa + (*p - '0'); if(mantissa) ndigits++; exponent--;}
+    }
+  }
+
+  if(p == digits || (p == digits + 1 && *digits == '.')) { /* No digits */
+    if(p < end && (*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N'))
+      return strtofloat(s, end, x); /* Infinity or not a number */
+    return 0;
+  }
+
+  if(p - digits == 1 && *digits == '0' && p < end && (*p == 'x' || *p == 'X'))
+    return strtofloat(s, end, x); /* Hexadecimal notation */
+
+  /* Exponent */
+  if(p < end && (*p == 'e' || *p == 'E')) {
+    const char * q = p + 1;
+    if(q < end && (*q == '-' || *q == '+')) esign = (*q++ == '-')?-1:1;
+    if(q < end && *q >= '0' && *q <= '9') {
+      for(; q < end && *q >= '0' && *q <= '9'; q++)
+        if(e < 10000) e = 10*e + (*q - '0');
+      exponent += esign*e;
+      p = q;
+    }
+  }
+
+  value = (double) mantissa;
+  if(mantissa != 0 && exponent != 0) {
+    if(exponent > 0 && exponent <= 22) value *= pow10[exponent];
+    else if(exponent < 0 && exponent >= -22) value /= pow10[-exponent];
+    else value *= pow(10.0, exponent);
+  }
+
+  *x = (float) (negative?-value:value);
+  return p - s;
+}
+
+/* Parse up to n numbers separated by blanks (as sscanf does with "%f %f...") */
+static __inline__ int parsefloats(const char * p, const char * end, float * dat, int n)
+{
+  int k, used; /* Number of values read, number of characters used */
+
+  for(k = 0; k < n; k++) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')) p++;
+    used = parsefloat(p, end, &dat[k]);
+    if(used == 0) break;
+    p += used;
+  }
+
+  return k;
+}
+
+/* Parse up to n non-negative integers separated by blanks */
+static __inline__ int parseints(const char * p, const char * end, int * dat, int n)
+{
+  int k; /* Number of values read */
+
+  for(k = 0; k < n; k++) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')) p++;
+    if(p == end || *p < '0' || *p > '9') break;
+    for(dat[k] = 0; p < end && *p >= '0' && *p <= '9'; p++)
+      dat[k] = (dat[k] < INT_MAX/10)?10*dat[k] + (*p - '0'):INT_MAX;
+  }
+
+  return k;
+}
+
+/* Read the next frame from an ASCII data file (false at the end of the file) */
+bool readtext(struct textreader * t, struct frame * f)
+{
+  char * line, * eol; /* Line in the text buffer */
+  char * p; /* Character in line */
+  float dat[5]; /* Position (x, y and z), radius and colour */
+  int s; /* Number of values read */
+
+  f->n = f->nbonds = 0;
+  f->newmsg = f->newcamera = false;
+
+  while((line = nextline(t, &eol))) {
+    s = parsefloats(line, eol, dat, 5);
+
+    if(s > 2) { /* Enough data to store a particle */
+      if(f->n == f->size) growframe(f, f->n + 1);
+      f->x[f->n] = dat[0];
+      f->y[f->n] = dat[1];
+      f->z[f->n] = dat[2];
+      f->R[f->n] = (s > 3)?dat[3]:1; /* Default radius */
+      f->c[f->n] = (s > 4)?(int) dat[4]:0xFAFAFA; /* Default colour */
+      f->n++;
+    }
+    else if(line < eol && line[0]=='#') { /* Ignore comments */
+      if(line + 1 < eol && line[1]=='%') { /* Magic commands */
+        for(p = line + 2; p < eol && isspace(*p); p++);
+        if(eol - p > 6 && !strncmp(p, "camera", 6) && isspace(p[6]))
+          f->newcamera = (parsefloats(p + 6, eol, f->camera, 9) == 9);
+        else if(eol - p > 4 && !strncmp(p, "bond", 4) && isspace(p[4])) {
+          growbonds(f, f->nbonds + 1);
+          if(parseints(p + 4, eol, f->bonds + 2*f->nbonds, 2) == 2) f->nbonds++;
+        }
+      }
+      else if(line + 1 < eol && line[1]=='\'') { /* Print text */
+        for(p = line + 2; p < eol && isspace(*p); p++);
+        if(p < eol) {
+          s = (eol - p < 249)?eol - p:249;
+          memcpy(f->msg, p, s);
+          f->msg[s] = '\0';
+          f->newmsg = true;
+        }
+      }
+    }
+    else return true; /* A blank line closes the frame */
+  }
+
+  /* Unterminated last frame (unless the rest of it is still to come) */
+  if(t->follow && !t->eof) return false;
+  return (f->n > 0);
+}
+
+/* Make room for the stored values of n particles in a keyframe */
+void growkeyframe(struct keyframe * key, int n)
+{
+  if(5*n <= key->size) return;
+
+  key->size = 5*n;
+  key->v = realloc(key->v, key->size*sizeof(uint32_t));
+  key->w = realloc(key->w, key->size*sizeof(uint32_t));
+  key->bytes = realloc(key->bytes, 5*key->size); /* Up to 5 bytes per value */
+  if(!key->v || !key->w || !key->bytes) {
+    fprintf(stderr, "Error: unable to allocate memory for %d particles.\n", n);
+    exit(-1);
+  }
+}
+
+/* Values of a frame as stored in a binary file: quantized (int16) or float
+   positions, then radii and colours unless they are in the header h */
+int storedvalues(struct frame * f, struct binheader * h, uint32_t * v)
+{
+  float * x[3] = {f->x, f->y, f->z}; /* Coordinates */
+  int i, k, m = 0; /* Indices, number of values */
+
+  for(k = 0; k < 3; k++)
+    if(h && (h->flags & BIN_INT16))
+      for(i = 0; i < f->n; i++)
+        v[m++] = (uint16_t) (lrintf((x[k][i] - h->offset[k])/h->scale[k]) - 32768);
+    else {
+      memcpy(v + m, x[k], f->n*sizeof(float));
+      m += f->n;
+    }
+  if(!h || !(h->flags & BIN_RADII)) {
+    memcpy(v + m, f->R, f->n*sizeof(float));
+    m += f->n;
+  }
+  if(!h || !(h->flags & BIN_COLOURS)) {
+    memcpy(v + m, f->c, f->n*sizeof(int));
+    m += f->n;
+  }
+
+  return m;
+}
+
+/* Set the particles of a frame from their stored values (the inverse of
+   storedvalues), with constant radii and colours taken from R and c */
+void loadvalues(struct frame * f, struct binheader * h, float * R, int * c,
+                const uint32_t * v)
+{
+  float * x[3] = {f->x, f->y, f->z}; /* Coordinates */
+  int i, k, m = 0; /* Indices, value */
+
+  for(k = 0; k < 3; k++)
+    if(h && (h->flags & BIN_INT16))
+      for(i = 0; i < f->n; i++)
+        x[k][i] = h->offset[k] + ((short) v[m++] + 32768)*h->scale[k];
+    else {
+      memcpy(x[k], v + m, f->n*sizeof(float));
+      m += f->n;
+    }
+  if(h && (h->flags & BIN_RADII)) memcpy(f->R, R, f->n*sizeof(float));
+  else {
+    memcpy(f->R, v + m, f->n*sizeof(float));
+    m += f->n;
+  }
+  if(h && (h->flags & BIN_COLOURS)) memcpy(f->c, c, f->n*sizeof(int));
+  else memcpy(f->c, v + m, f->n*sizeof(int));
+}
+
+/* Encode the differences between two sets of m values, as variable-length
+   integers in 7-bit groups: runs of unchanged values (odd codes, with the
+   length of the run) and other differences (even codes, zigzag encoded) */
+long encodedelta(const uint32_t * v, const uint32_t * key, int m, unsigned char * bytes)
+{
+  unsigned char * p = bytes; /* Next byte */
+  uint64_t code; /* Run or difference */
+  uint32_t d; /* Difference */
+  int i, run; /* Value, length of a run */
+
+  for(i = 0; i < m; i++) {
+    d = v[i] - key[i];
+    if(d == 0) {
+      for(run = 1; i + run < m && v[i + run] == key[i + run]; run++);
+      code = 2*(uint64_t) run + 1;
+      i += run - 1;
+    }
+    else code = 2*(uint64_t) ((d << 1) ^ (uint32_t) -(int32_t) (d >> 31));
+    while(code >= 128) {
+      *p++ = (code & 127) | 128;
+      code >>= 7;
+    }
+    *p++ = code;
+  }
+
+  return p - bytes;
+}
+
+/* Decode m values from their differences to a keyframe (false if the bytes
+   do not match) */
+bool decodedelta(const unsigned char * bytes, long nbytes, const uint32_t * key, int m,
+                 uint32_t * v)
+{
+  const unsigned char * p = bytes, * end = bytes + nbytes; /* Next byte, end */
+  uint64_t code; /* Run or difference */
+  uint32_t d; /* Zigzag difference */
+  int i, shift; /* Value, bits decoded */
+
+  for(i = 0; i < m;) {
+    for(code = 0, shift = 0; p < end && (*p & 128) && shift < 63; p++, shift += 7)
+      code |= (uint64_t) (*p & 127) << shift;
+    if(p == end) return false;
+    code |= (uint64_t) *p++ << shift;
+
+    if(code & 1) { /* Unchanged values */
+      if(code/2 > (uint64_t) (m - i)) return false;
+      memcpy(v + i, key + i, code/2*sizeof(uint32_t));
+      i += code/2;
+    }
+    else {
+      d = code/2;
+      v[i] = key[i] + ((d >> 1) ^ -(d & 1));
+      i++;
+    }
+  }
+
+  return (p == end);
+}
+
+/* Append a frame to a binary trajectory or the frame cache (with h = NULL).
+   With a keyframe, the frame is stored as differences from it, unless it is
+   time for a new keyframe or the differences would take more space. */
+void writebinary(FILE * file, struct frame * f, struct binheader * h, struct keyframe * key)
+{
+  int header[2]; /* Number of particles and flags */
+  short * q; /* Quantized positions */
+  float * x[3] = {f->x, f->y, f->z}; /* Coordinates */
+  long long keypos; /* Position of the keyframe */
+  long pos = ftell(file); /* Position of the frame */
+  long long nbytes = 0; /* Size of the encoded differences */
+  int i, k, m = 0; /* Indices, number of values */
+
+  header[0] = f->n;
+  header[1] = (f->newmsg?FRAME_MSG:0) | (f->newcamera?FRAME_CAMERA:0)
+              | (f->nbonds?FRAME_BONDS:0);
+
+  if(key) { /* Differences from the keyframe, if worth it */
+    growkeyframe(key, f->n);
+    m = storedvalues(f, h, key->w);
+    if(key->loaded && key->n == f->n && key->count < KEYFRAME_INTERVAL) {
+      nbytes = encodedelta(key->w, key->v, m, key->bytes);
+      if(nbytes < (m - ((h && (h->flags & BIN_INT16))?1.5:0)*f->n)*sizeof(uint32_t))
+        header[1] |= FRAME_DELTA;
+    }
+  }
+
+  fwrite(header, sizeof(int), 2, file);
+  if(header[1] & FRAME_DELTA) {
+    keypos = key->pos;
+    fwrite(&keypos, sizeof(long long), 1, file);
+  }
+  if(f->newmsg) fwrite(f->msg, sizeof(char), 250, file);
+  if(f->newcamera) fwrite(f->camera, sizeof(float), 9, file);
+  if(f->nbonds) {
+    fwrite(&f->nbonds, sizeof(int), 1, file);
+    fwrite(f->bonds, sizeof(int), 2*f->nbonds, file);
+  }
+
+  if(header[1] & FRAME_DELTA) {
+    fwrite(&nbytes, sizeof(long long), 1, file);
+    fwrite(key->bytes, 1, nbytes, file);
+    key->count++;
+    return;
+  }
+  if(key) { /* New keyframe */
+    memcpy(key->v, key->w, m*sizeof(uint32_t));
+    key->loaded = true;
+    key->pos = pos;
+    key->n = f->n;
+    key->m = m;
+    key->count = 1;
+  }
+
+  if(h && (h->flags & BIN_INT16)) {
+    q = malloc(f->n*sizeof(short) + 1);
+    if(q == NULL) {
+      fprintf(stderr, "Error: unable to allocate memory for %d particles.\n", f->n);
+      exit(-1);
+    }
+    for(k = 0; k < 3; k++) {
+      for(i = 0; i < f->n; i++)
+        q[i] = (short) (lrintf((x[k][i] - h->offset[k])/h->scale[k]) - 32768);
+      fwrite(q, sizeof(short), f->n, file);
+    }
+    free(q);
+  }
+  else
+    for(k = 0; k < 3; k++) fwrite(x[k], sizeof(float), f->n, file);
+
+  if(!h || !(h->flags & BIN_RADII)) fwrite(f->R, sizeof(float), f->n, file);
+  if(!h || !(h->flags & BIN_COLOURS)) fwrite(f->c, sizeof(int), f->n, file);
+}
+
+/* Read a frame from a binary trajectory or the frame cache (with h = NULL).
+   Constant radii and colours are taken from R and c. Delta-encoded frames
+   need a keyframe, which is read first if it is not the one held. */
+bool readbinary(FILE * file, long pos, struct binheader * h, float * R, int * c,
+                struct frame * f, struct keyframe * key)
+{
+  static short * q = NULL; /* Quantized positions */
+  static int qsize = 0; /* Allocated quantized positions */
+  int header[2]; /* Number of particles and flags */
+  long long keypos = -1; /* Position of the keyframe */
+  long long nbytes; /* Size of the encoded differences */
+  float * x[3]; /* Coordinates */
+  struct stat st; /* File status */
+  long left; /* Bytes after the frame header */
+  int i, k; /* Indices */
+
+  /* Counts are checked against the size of the file before anything is
+     allocated, since a corrupt file could hold any value (the seek flushes
+     frames still being written to the cache) */
+  if(fseek(file, pos, SEEK_SET) || fstat(fileno(file), &st)) return false;
+  if(fread(header, sizeof(int), 2, file) != 2) return false;
+  left = st.st_size - pos - 2*sizeof(int);
+  if(header[0] < 0 || (!(header[1] & FRAME_DELTA) && header[0] > left/6)) return false;
+  if(h && (h->flags & (BIN_RADII | BIN_COLOURS)) && header[0] != h->n) return false;
+  if(header[1] & FRAME_DELTA) {
+    if(key == NULL || fread(&keypos, sizeof(long long), 1, file) != 1) return false;
+    if(keypos < 0 || keypos >= pos) return false; /* Keyframes come first */
+    if(!key->loaded || key->pos != keypos) { /* Read the keyframe */
+      if(!readbinary(file, keypos, h, R, c, f, key)) return false;
+      if(fseek(file, pos + 2*sizeof(int) + sizeof(long long), SEEK_SET)) return false;
+    }
+    if(key->n != header[0]) return false;
+  }
+
+  growframe(f, header[0]);
+  f->n = header[0];
+  f->newmsg = header[1] & FRAME_MSG;
+  f->newcamera = header[1] & FRAME_CAMERA;
+  x[0] = f->x; x[1] = f->y; x[2] = f->z;
+
+  if(f->newmsg && fread(f->msg, sizeof(char), 250, file) != 250) return false;
+  if(f->newcamera && fread(f->camera, sizeof(float), 9, file) != 9) return false;
+  f->nbonds = 0;
+  if(header[1] & FRAME_BONDS) {
+    if(fread(&k, sizeof(int), 1, file) != 1 || k < 0 || k > left/(2*sizeof(int)))
+      return false;
+    growbonds(f, k);
+    if(fread(f->bonds, sizeof(int), 2*k, file) != 2*k) return false;
+    f->nbonds = k;
+  }
+
+  if(header[1] & FRAME_DELTA) { /* Differences from the keyframe */
+    if(fread(&nbytes, sizeof(long long), 1, file) != 1 || nbytes < 0 || nbytes > 5LL*key->m)
+      return false;
+    if(fread(key->bytes, 1, nbytes, file) != nbytes
+       || !decodedelta(key->bytes, nbytes, key->v, key->m, key->w)) return false;
+    loadvalues(f, h, R, c, key->w);
+    return true;
+  }
+
+  if(h && (h->flags & BIN_INT16)) {
+    if(qsize < f->n) {
+      qsize = f->n;
+      q = realloc(q, qsize*sizeof(short));
+      if(q == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %d particles.\n", f->n);
+        exit(-1);
+      }
+    }
+    if(key) growkeyframe(key, f->n);
+    for(k = 0; k < 3; k++) {
+      if(fread(q, sizeof(short), f->n, file) != f->n) return false;
+      for(i = 0; i < f->n; i++)
+        x[k][i] = h->offset[k] + (q[i] + 32768)*h->scale[k];
+      if(key) /* Quantized values of the keyframe */
+        for(i = 0; i < f->n; i++) key->v[k*f->n + i] = (uint16_t) q[i];
+    }
+  }
+  else
+    for(k = 0; k < 3; k++)
+      if(fread(x[k], sizeof(float), f->n, file) != f->n) return false;
+
+  if(h && (h->flags & BIN_RADII)) memcpy(f->R, R, f->n*sizeof(float));
+  else if(fread(f->R, sizeof(float), f->n, file) != f->n) return false;
+  if(h && (h->flags & BIN_COLOURS)) memcpy(f->c, c, f->n*sizeof(int));
+  else if(fread(f->c, sizeof(int), f->n, file) != f->n) return false;
+
+  if(key) { /* Every frame that is not delta-encoded can be a keyframe */
+    if(h && (h->flags & BIN_INT16)) { /* Quantized positions kept above */
+      key->m = 3*f->n;
+      if(!(h->flags & BIN_RADII)) {
+        memcpy(key->v + key->m, f->R, f->n*sizeof(float));
+        key->m += f->n;
+      }
+      if(!(h->flags & BIN_COLOURS)) {
+        memcpy(key->v + key->m, f->c, f->n*sizeof(int));
+        key->m += f->n;
+      }
+    }
+    else {
+      growkeyframe(key, f->n);
+      key->m = storedvalues(f, h, key->v);
+    }
+    key->loaded = true;
+    key->pos = pos;
+    key->n = f->n;
+  }
+
+  return true;
+}
+
+/* Copy the frames of the cache from index entry m onwards into a new cache,
+   which replaces it (false if they cannot be copied, leaving the cache as it
+   was) */
+bool rewritecache(struct trajectory * t, int m)
+{
+  FILE * cache = tmpfile(); /* New cache */
+  struct frame f = {0}; /* Frame copied */
+  struct keyframe key = {0}, tmp; /* Keyframe written last to the new cache, swap */
+  int n = t->nframes - t->first; /* Index entries */
+  long * pos = malloc(n*sizeof(long) + 1); /* Positions in the new cache */
+  int i; /* Index entry */
+  bool ok; /* Frames copied */
+
+  for(i = m; cache != NULL && pos != NULL && i < n; i++) {
+    if(!readbinary(t->cache, t->cachepos[i], NULL, NULL, NULL, &f, &t->key)) break;
+    pos[i] = ftell(cache);
+    writebinary(cache, &f, NULL, t->delta?&key:NULL);
+  }
+  ok = (cache != NULL && pos != NULL && i == n && fflush(cache) == 0);
+  if(ok) {
+    fclose(t->cache);
+    t->cache = cache;
+    memcpy(t->cachepos + m, pos + m, (n - m)*sizeof(long));
+    tmp = t->cachekey;
+    t->cachekey = key;
+    key = tmp;
+    t->key.loaded = false; /* Its position was in the old cache */
+  }
+  else if(cache != NULL) fclose(cache);
+
+  free(key.v); free(key.w); free(key.bytes);
+  free(f.x); free(f.y); free(f.z); free(f.R); free(f.c); free(f.bonds);
+  free(pos);
+  return ok;
+}
+
+/* Drop the oldest m frames from the index of live data, and free their space
+   in the cache (except for the keyframes of the frames kept): by punching a
+   hole in the file, which keeps the offsets valid, or if the file system
+   cannot, by copying the frames kept into a new cache */
+void dropframes(struct trajectory * t, int m)
+{
+  int n = t->nframes - t->first - m; /* Frames kept */
+  static bool warned = false; /* The cache could not be shrunk */
+
+  if(t->cache && m > KEYFRAME_INTERVAL) {
+    fflush(t->cache);
+    if(fallocate(fileno(t->cache), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                 t->cachepos[m - KEYFRAME_INTERVAL]) != 0
+       && !rewritecache(t, m) && !warned) {
+      fprintf(stderr, "Warning: unable to free the space of old frames in the cache.\n");
+      warned = true;
+    }
+  }
+  memmove(t->textpos, t->textpos + m, n*sizeof(long));
+  memmove(t->cachepos, t->cachepos + m, n*sizeof(long));
+  memmove(t->nparticles, t->nparticles + m, n*sizeof(int));
+  t->first += m;
+}
+
+/* Add a frame to the trajectory index */
+void indexframe(struct trajectory * t, long textpos, long cachepos, int n)
+{
+  if(t->nframes - t->first == t->size) {
+    t->size = t->size?2*t->size:256;
+    t->textpos = realloc(t->textpos, t->size*sizeof(long));
+    t->cachepos = realloc(t->cachepos, t->size*sizeof(long));
+    t->nparticles = realloc(t->nparticles, t->size*sizeof(int));
+    if(!t->textpos || !t->cachepos || !t->nparticles) {
+      fprintf(stderr, "Error: unable to allocate memory for the frame index.\n");
+      exit(-1);
+    }
+  }
+
+  t->textpos[t->nframes - t->first] = textpos;
+  t->cachepos[t->nframes - t->first] = cachepos;
+  t->nparticles[t->nframes - t->first] = n;
+  t->nframes++;
+}
+
+/* Load frame number k of a trajectory (false if there is no such frame, or
+   if it was dropped). Frames are parsed from the data file only once: they are
+   indexed on the first pass and read back from the binary cache afterwards. */
+bool getframe(struct trajectory * t, int k, struct frame * f)
+{
+  long pos; /* Position in a stream */
+  int i = k - t->first; /* Index entry */
+
+  if(i < 0) return false;
+
+  if(k < t->nframes) { /* Indexed frame */
+    if(t->binary) {
+      if(!readbinary(t->binary, t->cachepos[i], &t->bin, t->binR, t->binc, f, &t->key)) {
+        fprintf(stderr, "Error: corrupt binary trajectory (frame %d).\n", k);
+        exit(-1);
+      }
+      return true;
+    }
+    if(t->cache) return readbinary(t->cache, t->cachepos[i], NULL, NULL, NULL, f, &t->key);
+    if(!seektext(&t->text, t->textpos[i])) return false;
+    if(!readtext(&t->text, f)) return false;
+    if(k + 2 < t->nframes) /* Pages of the next frame */
+      prefetchtext(&t->text, t->textpos[i + 1], t->textpos[i + 2] - t->textpos[i + 1]);
+    return true;
+  }
+
+  if(t->complete) return false;
+
+  /* Without a cache, the data file may point to an earlier frame */
+  if(!t->cache && telltext(&t->text) != t->textend)
+    if(!seektext(&t->text, t->textend)) return false;
+
+  /* Index new frames up to frame k */
+  while(!t->complete) {
+    pos = telltext(&t->text);
+    t->text.keep = pos;
+    if(!readtext(&t->text, f)) {
+      if(t->text.follow && !t->text.eof) { /* The next frame is still to come */
+        seektext(&t->text, pos);
+        return false;
+      }
+      t->complete = true;
+      return false;
+    }
+    t->textend = telltext(&t->text);
+    /* Pages of the next frame, assuming it is not much larger than this one */
+    prefetchtext(&t->text, t->textend, 2*(t->textend - pos));
+
+    /* Only the newest FOLLOW_FRAMES frames of live data are kept, so that
+       following a simulation for hours does not use more and more memory
+       and disk space (this may replace the cache) */
+    if(t->text.follow && t->nframes - t->first == FOLLOW_FRAMES)
+      dropframes(t, FOLLOW_FRAMES/2);
+
+    if(t->cache) {
+      fseek(t->cache, 0, SEEK_END);
+      indexframe(t, pos, ftell(t->cache), f->n);
+      writebinary(t->cache, f, NULL, t->delta?&t->cachekey:NULL);
+    }
+    else indexframe(t, pos, -1, f->n);
+
+    if(t->nframes > k) return true;
+  }
+
+  return false;
+}
+
+/* Index the complete frames that have arrived in live data, and load the
+   newest one as frame *k (false if none has arrived). Older frames are only
+   indexed (and cached), and parsing stops after FOLLOW_WAIT milliseconds to
+   show a frame even if the data comes in faster. */
+bool followframe(struct trajectory * t, int * k, struct frame * f, struct frame * spare)
+{
+  double t0 = seconds(); /* Start time */
+  struct frame tmp; /* Frame swap */
+  bool ok = false; /* A frame has arrived */
+
+  while(getframe(t, t->nframes, spare)) {
+    tmp = *f;
+    *f = *spare;
+    *spare = tmp;
+    ok = true;
+    if(seconds() - t0 > 1e-3*FOLLOW_WAIT) break;
+  }
+  if(!ok && !t->complete) waittext(&t->text);
+  *k = t->nframes - 1;
+
+  return ok;
+}
+
+/* Open a binary trajectory (false if the file does not contain one) */
+bool openbinary(struct trajectory * t, FILE * file)
+{
+  long pos = ftell(file); /* Position in the file */
+  long long * offsets; /* Positions of frames */
+  int * counts; /* Numbers of particles */
+  struct stat st; /* File status */
+  int k; /* Frame index */
+
+  if(pos < 0) return false; /* Pipes are always read as text */
+  if(fread(&t->bin, sizeof(struct binheader), 1, file) != 1
+     || strncmp(t->bin.magic, "MPB1", 4)) {
+    fseek(file, pos, SEEK_SET);
+    return false;
+  }
+
+  /* Counts and offsets within the file (every particle takes at least 6 bytes
+     in some frame, a keyframe if not its own) */
+  if(fstat(fileno(file), &st) || t->bin.n < 0 || t->bin.n > st.st_size/4
+     || t->bin.nframes < 0 || t->bin.index < (long long) sizeof(struct binheader)
+     || t->bin.nframes > (st.st_size - t->bin.index)/(sizeof(long long) + sizeof(int))) {
+    fprintf(stderr, "Error: corrupt binary trajectory header.\n");
+    exit(-1);
+  }
+
+  /* Constant radii and colours */
+  if(t->bin.flags & BIN_RADII) {
+    t->binR = malloc(t->bin.n*sizeof(float) + 1);
+    if(!t->binR || fread(t->binR, sizeof(float), t->bin.n, file) != t->bin.n) {
+      fprintf(stderr, "Error: unable to read binary trajectory radii.\n");
+      exit(-1);
+    }
+  }
+  if(t->bin.flags & BIN_COLOURS) {
+    t->binc = malloc(t->bin.n*sizeof(int) + 1);
+    if(!t->binc || fread(t->binc, sizeof(int), t->bin.n, file) != t->bin.n) {
+      fprintf(stderr, "Error: unable to read binary trajectory colours.\n");
+      exit(-1);
+    }
+  }
+
+  /* Frame index */
+  offsets = malloc(t->bin.nframes*sizeof(long long) + 1);
+  counts = malloc(t->bin.nframes*sizeof(int) + 1);
+  if(!offsets || !counts || fseek(file, t->bin.index, SEEK_SET)
+     || fread(offsets, sizeof(long long), t->bin.nframes, file) != t->bin.nframes
+     || fread(counts, sizeof(int), t->bin.nframes, file) != t->bin.nframes) {
+    fprintf(stderr, "Error: unable to read binary trajectory index.\n");
+    exit(-1);
+  }
+  for(k = 0; k < t->bin.nframes; k++) {
+    if(offsets[k] < (long long) sizeof(struct binheader) || offsets[k] >= t->bin.index
+       || counts[k] < 0 || counts[k] > st.st_size/6
+       || ((t->bin.flags & (BIN_RADII | BIN_COLOURS)) && counts[k] != t->bin.n)) {
+      fprintf(stderr, "Error: corrupt binary trajectory index (frame %d).\n", k);
+      exit(-1);
+    }
+    indexframe(t, -1, offsets[k], counts[k]);
+  }
+  free(offsets);
+  free(counts);
+
+  t->binary = file;
+  t->complete = true;
+  return true;
+}
+
+/* Bond the particles of a frame closer than a cutoff. Particles are sorted
+   into a cell list, with cells at least as large as the cutoff (and no more
+   cells than particles), so that only neighbouring cells are searched and
+   the time grows linearly with the number of particles. */
+void findbonds(struct frame * f, float cutoff, struct celllist * l)
+{
+  float lo[3], hi[3], cell; /* Bounding box, cell size */
+  float * x[3] = {f->x, f->y, f->z}; /* Coordinates */
+  float d[3], * p; /* Distance between particles, sorted position */
+  int a[3], b[3], lim[2][3]; /* Cell, neighbouring cell, their range */
+  int ncells, c, n, i, j, k; /* Number of cells, cell, sorted particles, indices */
+
+  f->nbonds = 0;
+  if(f->n < 2 || !(cutoff > 0)) return;
+
+  for(k = 0; k < 3; k++) lo[k] = hi[k] = x[k][0];
+  for(i = 1; i < f->n; i++)
+    for(k = 0; k < 3; k++) {
+      if(x[k][i] < lo[k]) lo[k] = x[k][i];
+      if(x[k][i] > hi[k]) hi[k] = x[k][i];
+    }
+
+  /* Cells (larger than the cutoff in sparse systems) */
+  for(cell = cutoff;; cell *= 1.25f) {
+    for(k = 0; k < 3; k++) {
+      d[k] = (hi[k] - lo[k])/cell;
+      l->side[k] = (d[k] >= 1)?(int) fminf(d[k], f->n):1;
+    }
+    if((double) l->side[0]*l->side[1]*l->side[2] <= f->n) break;
+  }
+  ncells = l->side[0]*l->side[1]*l->side[2];
+  if(l->ncells < ncells) {
+    l->ncells = ncells;
+    l->start = realloc(l->start, (ncells + 1)*sizeof(int));
+  }
+  if(l->size < f->n) {
+    l->size = f->n;
+    l->cell = realloc(l->cell, f->n*sizeof(int));
+    l->index = realloc(l->index, f->n*sizeof(int));
+    l->pos = realloc(l->pos, 3*f->n*sizeof(float));
+  }
+  if(!l->start || !l->cell || !l->index || !l->pos) {
+    fprintf(stderr, "Error: unable to allocate memory for the cell list.\n");
+    exit(-1);
+  }
+
+  /* Sort the particles by cell (counting sort), with their positions */
+  for(c = 0; c <= ncells; c++) l->start[c] = 0;
+  for(i = 0; i < f->n; i++) {
+    for(c = 0, k = 2; k >= 0; k--) {
+      a[k] = (x[k][i] - lo[k])/(hi[k] - lo[k])*l->side[k];
+      if(!(a[k] > 0)) a[k] = 0;
+      if(a[k] >= l->side[k]) a[k] = l->side[k] - 1;
+      c = c*l->side[k] + a[k];
+    }
+    l->cell[i] = c;
+    l->start[c + 1]++;
+  }
+  for(c = 0; c < ncells; c++) l->start[c + 1] += l->start[c];
+  for(i = 0; i < f->n; i++) {
+    n = l->start[l->cell[i]]++;
+    l->index[n] = i;
+    for(k = 0; k < 3; k++) l->pos[3*n + k] = x[k][i];
+  }
+  for(c = ncells; c > 0; c--) l->start[c] = l->start[c - 1];
+  l->start[0] = 0;
+
+  /* Pairs within the cutoff in the same and neighbouring cells */
+  for(c = 0; c < ncells; c++) {
+    if(l->start[c] == l->start[c + 1]) continue;
+    for(n = c, k = 0; k < 3; k++) {
+      a[k] = n%l->side[k];
+      n /= l->side[k];
+      lim[0][k] = (a[k] > 0)?a[k] - 1:0;
+      lim[1][k] = (a[k] < l->side[k] - 1)?a[k] + 1:l->side[k] - 1;
+    }
+    for(b[2] = lim[0][2]; b[2] <= lim[1][2]; b[2]++)
+      for(b[1] = lim[0][1]; b[1] <= lim[1][1]; b[1]++)
+        for(b[0] = lim[0][0]; b[0] <= lim[1][0]; b[0]++) {
+          n = (b[2]*l->side[1] + b[1])*l->side[0] + b[0];
+          if(n < c) continue; /* Each pair of cells once */
+          for(i = l->start[c]; i < l->start[c + 1]; i++)
+            for(j = (n == c)?i + 1:l->start[n]; j < l->start[n + 1]; j++) {
+              p = l->pos + 3*i;
+              for(k = 0; k < 3; k++) d[k] = l->pos[3*j + k] - p[k];
+              if(dot(d, d) >= cutoff*cutoff) continue;
+              growbonds(f, f->nbonds + 1);
+              f->bonds[2*f->nbonds] = l->index[i];
+              f->bonds[2*f->nbonds + 1] = l->index[j];
+              f->nbonds++;
+            }
+        }
+  }
+}
+
+/*** Frame pipeline ***/
+
+/* Reader thread: parse frames ahead of the render loop */
+void * reader(void * arg)
+{
+  struct pipeline * p = arg; /* Frame pipeline */
+  struct frame f = {0}, tmp; /* Frame being read */
+  struct frame spare = {0}; /* Older live frame */
+  struct celllist cells = {{0}}; /* Cell list for automatic bonds */
+  int k, generation; /* Frame number, number of seeks */
+  bool ok; /* Frame read */
+  bool live; /* Reading new frames of live data */
+
+  pthread_mutex_lock(&p->lock);
+  while(!p->quit) {
+    /* Backpressure: wait for space in the queue (new live frames replace the
+       queued ones instead) */
+    live = p->traj->text.follow && !p->traj->complete && p->next >= p->traj->nframes;
+    if(p->count == p->depth && !live) {
+      pthread_cond_wait(&p->notfull, &p->lock);
+      continue;
+    }
+
+    /* Negative frame numbers count from the end of the trajectory */
+    k = p->next;
+    if(k < 0) k = p->traj->complete?p->traj->nframes + k:0;
+    if(k < p->traj->first) k = p->traj->first; /* Dropped live frames */
+    generation = p->generation;
+
+    pthread_mutex_unlock(&p->lock);
+    f.readtime = seconds();
+    if(live) ok = followframe(p->traj, &k, &f, &spare);
+    else ok = getframe(p->traj, k, &f);
+    if(ok && p->traj->cutoff > 0 && f.nbonds == 0) findbonds(&f, p->traj->cutoff, &cells);
+    f.readtime = seconds() - f.readtime;
+    pthread_mutex_lock(&p->lock);
+
+    if(generation != p->generation) continue; /* Seek while reading */
+
+    if(!ok && live && !p->traj->complete) continue; /* Waiting for live data */
+    if(!ok) {
+      if(k > 0 && p->loop) p->next = 0; /* Back to the first frame */
+      else { /* No frames to read */
+        p->end = true;
+        pthread_cond_signal(&p->notempty);
+        pthread_cond_wait(&p->notfull, &p->lock);
+      }
+      continue;
+    }
+
+    if(live && p->count > 0) { /* Drop the stale frames */
+      p->head = (p->head + p->count)%p->depth;
+      p->count = 0;
+    }
+
+    /* Swap the frame into the queue (the slot keeps the old arrays) */
+    tmp = p->slots[(p->head + p->count)%p->depth];
+    p->slots[(p->head + p->count)%p->depth] = f;
+    p->number[(p->head + p->count)%p->depth] = k;
+    f = tmp;
+    p->count++;
+    p->next = k + p->step;
+    pthread_cond_signal(&p->notempty);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+/* Start reading every step-th frame of a trajectory, beginning with frame k
+   (and looping back to the first frame if loop is set) */
+void startpipeline(struct pipeline * p, struct trajectory * traj, int depth, int k,
+                   int step, bool loop)
+{
+  p->traj = traj;
+  p->depth = (depth > 0)?depth:1;
+  p->slots = calloc(p->depth, sizeof(struct frame));
+  p->number = calloc(p->depth, sizeof(int));
+  if(p->slots == NULL || p->number == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the frame queue.\n");
+    exit(-1);
+  }
+  p->head = p->count = p->generation = 0;
+  p->next = k;
+  p->step = (step > 0)?step:1;
+  p->loop = loop;
+  p->end = p->quit = false;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->notfull, NULL);
+  pthread_cond_init(&p->notempty, NULL);
+
+  if(pthread_create(&p->thread, NULL, reader, p)) {
+    fprintf(stderr, "Error: unable to start the reader thread.\n");
+    exit(-1);
+  }
+}
+
+/* Take the next frame from the queue, waiting at most a few milliseconds
+   (false if no frame is ready). The frame swaps arrays with the queue. */
+bool popframe(struct pipeline * p, struct frame * f, int * k)
+{
+  struct timespec deadline; /* Time limit */
+  struct frame tmp; /* Frame swap */
+  bool ok = false; /* Frame ready */
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += 10000000; /* 10 ms */
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  if(p->count == 0) pthread_cond_timedwait(&p->notempty, &p->lock, &deadline);
+  if(p->count > 0) {
+    tmp = *f;
+    *f = p->slots[p->head];
+    p->slots[p->head] = tmp;
+    *k = p->number[p->head];
+    p->head = (p->head + 1)%p->depth;
+    p->count--;
+    pthread_cond_signal(&p->notfull);
+    ok = true;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return ok;
+}
+
+/* Drop the frames read ahead and continue from frame k (negative values
+   count from the end of the trajectory) */
+void seekpipeline(struct pipeline * p, int k)
+{
+  pthread_mutex_lock(&p->lock);
+  p->generation++;
+  p->count = 0;
+  p->next = k;
+  p->end = false;
+  pthread_cond_signal(&p->notfull);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Skip ahead from the frame shown to frame k: drop the queued frames before
+   k (keeping the last one not after it), and go on reading from frame k if
+   the reader is further behind. Frames read after looping back are kept. */
+int skippipeline(struct pipeline * p, int shown, int k)
+{
+  int dropped = 0; /* Frames dropped from the queue */
+  int next; /* Number of the second queued frame */
+
+  pthread_mutex_lock(&p->lock);
+  while(p->count > 1 && p->number[p->head] > shown) {
+    next = p->number[(p->head + 1)%p->depth];
+    if(next > k || next < p->number[p->head]) break;
+    p->head = (p->head + 1)%p->depth;
+    p->count--;
+    dropped++;
+  }
+  if(p->next > shown && p->next < k) {
+    p->generation++; /* Drop the frame being read */
+    p->next = k;
+  }
+  if(dropped) pthread_cond_signal(&p->notfull);
+  pthread_mutex_unlock(&p->lock);
+
+  return dropped;
+}
+
+/* All the frames have been taken from the queue (when not looping) */
+bool endpipeline(struct pipeline * p)
+{
+  bool end; /* End of the trajectory */
+
+  pthread_mutex_lock(&p->lock);
+  end = p->end && p->count == 0;
+  pthread_mutex_unlock(&p->lock);
+
+  return end;
+}
+
+/* Stop the reader thread */
+void stoppipeline(struct pipeline * p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_signal(&p->notfull);
+  pthread_mutex_unlock(&p->lock);
+  pthread_cancel(p->thread); /* In case it is waiting for data */
+  pthread_join(p->thread, NULL);
+}
+
+/*** Rendering ***/
+
+/* Sort the particles of a frame into a coarse uniform grid, so that projecting
+   it again (while it stays on screen) skips whole cells out of view. Small
+   frames are not worth it and get no grid. */
+void buildgrid(struct grid * g, struct frame * f)
+{
+  float * x[3] = {f->x, f->y, f->z}; /* Positions */
+  float hi[3]; /* Upper corner */
+  int i, k, c, t; /* Coordinate, particle, cell indices and cell coordinate */
+
+  g->n = 0;
+  if(f->n < GRID_MIN) return;
+
+  /* Bounding box, cut into about GRID_OCCUPANCY particles per cell */
+  for(i = 0; i < 3; i++) g->lo[i] = hi[i] = x[i][0];
+  for(k = 1; k < f->n; k++)
+    for(i = 0; i < 3; i++) {
+      if(x[i][k] < g->lo[i]) g->lo[i] = x[i][k];
+      if(x[i][k] > hi[i]) hi[i] = x[i][k];
+    }
+  g->side = (int) cbrt(f->n/GRID_OCCUPANCY);
+  if(g->side > 128) g->side = 128;
+  g->ncells = g->side*g->side*g->side;
+  g->reach = 0;
+  for(i = 0; i < 3; i++) {
+    g->cell[i] = (hi[i] - g->lo[i])/g->side;
+    if(!(g->cell[i] > 0)) g->cell[i] = 1;
+    g->reach += 0.25f*g->cell[i]*g->cell[i];
+  }
+  g->reach = sqrtf(g->reach);
+
+  if(g->maxcells < g->ncells) {
+    g->maxcells = g->ncells;
+    g->rmax = realloc(g->rmax, g->maxcells*sizeof(float));
+    g->start = realloc(g->start, (g->maxcells + 1)*sizeof(int));
+  }
+  if(g->size < f->n) {
+    g->size = f->n;
+    g->index = realloc(g->index, g->size*sizeof(int));
+  }
+  growframe(&g->sorted, f->n);
+  if(!g->rmax || !g->start || !g->index) {
+    fprintf(stderr, "Error: unable to allocate memory for the particle grid.\n");
+    exit(-1);
+  }
+
+  /* Count the particles in each cell, then copy them in cell order, so
+     that projection reads them in sequence */
+  for(c = 0; c < g->ncells; c++) g->rmax[c] = 0;
+  for(c = 0; c <= g->ncells; c++) g->start[c] = 0;
+  for(k = 0; k < f->n; k++) {
+    for(c = 0, i = 2; i >= 0; i--) {
+      t = (int) ((x[i][k] - g->lo[i])/g->cell[i]);
+      c = c*g->side + ((t < 0)?0:(t >= g->side)?g->side - 1:t);
+    }
+    g->index[k] = c;
+    g->start[c + 1]++;
+    if(f->R[k] > g->rmax[c]) g->rmax[c] = f->R[k];
+  }
+  for(c = 0; c < g->ncells; c++) g->start[c + 1] += g->start[c];
+  for(k = 0; k < f->n; k++) {
+    t = g->start[g->index[k]]++;
+    g->sorted.x[t] = f->x[k];
+    g->sorted.y[t] = f->y[k];
+    g->sorted.z[t] = f->z[k];
+    g->sorted.R[t] = f->R[k];
+    g->sorted.c[t] = f->c[k];
+  }
+  for(c = g->ncells; c > 0; c--) g->start[c] = g->start[c - 1]; /* Copying moved them */
+  g->start[0] = 0;
+
+  g->n = g->sorted.n = f->n;
+}
+
+/* Project particle k of a frame on the screen, unless it cannot be seen:
+   behind the camera, beyond the background or off the screen (with its radius).
+   With merge, a sub-pixel particle is added to the sum of its pixel instead. */
+static __inline__ void projectparticle(struct frame * f, struct camera * cam, int width,
+                                       int height, float far, struct projection * p, int k,
+                                       bool merge)
+{
+  struct pixelsum * sum; /* Merged particles on the pixel */
+  float r[3]; /* Camera-particle displacement vector */
+  float depth; /* Depth of particle measured from camera */
+  float x, y, s; /* Screen coordinates and radius */
+  int n = p->n; /* Index of the projected particle */
+
+  /* Camera-particle vector */
+  r[0] = f->x[k] - cam->location[0];
+  r[1] = f->y[k] - cam->location[1];
+  r[2] = f->z[k] - cam->location[2];
+
+  /* Depth of particle measured from camera (the depth test subtracts up to 1) */
+  depth = dot(r, cam->direction)/3.732;
+  if(!(depth > 1) || depth - 1 >= far) return;
+
+  /* Screen coordinates of particle, roughly tested before rounding */
+  x = 0.5f*width*(1 + dot(r, cam->screenx)/depth);
+  y = 0.5f*height*(1 - dot(r, cam->screeny)/depth);
+  s = 0.5f*width*f->R[k]/depth;
+  if(x + s < -1 || x - s > width + 1 || y + s < -1 || y - s > height + 1) return;
+  p->xs[n] = (int) x;
+  p->ys[n] = (int) y;
+  p->s[n] = (int) s;
+
+  /* Discs are drawn inside [1, width) x [1, height) */
+  if(p->xs[n] + p->s[n] < 1 || p->xs[n] - p->s[n] > width - 1
+     || p->ys[n] + p->s[n] < 1 || p->ys[n] - p->s[n] > height - 1) return;
+  if(merge && p->s[n] == 0) {
+    sum = p->sums + width*p->ys[n] + p->xs[n];
+    if(sum->n == 0 || depth < sum->depth) sum->depth = depth;
+    if(sum->n < PIXELSUM_MAX)
+      sum->rgb += ((uint64_t) (f->c[k] >> 16 & 0xFF) << 42)
+                  + ((uint64_t) (f->c[k] >> 8 & 0xFF) << 21) + (f->c[k] & 0xFF);
+    sum->n++;
+    p->merged++;
+    return;
+  }
+  p->depth[n] = depth;
+  p->c[n] = f->c[k];
+  p->n++;
+}
+
+/* Screen box of a projected bond (its half widths around both ends, with the
+   last pixels included as in the boxes of the discs) */
+static __inline__ void bondbox(struct segment * b, int box[4])
+{
+  float w = b->size/fminf(b->depth[0], b->depth[1]); /* Largest half width */
+
+  box[0] = (int) floorf(fminf(b->x[0], b->x[1]) - w);
+  box[1] = (int) floorf(fminf(b->y[0], b->y[1]) - w);
+  box[2] = (int) (fmaxf(b->x[0], b->x[1]) + w);
+  box[3] = (int) (fmaxf(b->y[0], b->y[1]) + w);
+}
+
+/* Project the bonds of a frame on the screen, leaving out those with an end
+   behind the camera or beyond the background, those off the screen and
+   those too short to be seen between their particles */
+void projectbonds(struct frame * f, struct camera * cam, int width, int height,
+                  struct projection * p)
+{
+  float far = FAR_PLANE*cam->distance; /* Depth of the background */
+  float r[3]; /* Camera-particle displacement vector */
+  struct segment * b; /* Projected bond */
+  int box[4]; /* Screen box of the bond */
+  int i, e, k; /* Bond, end, particle */
+
+  if(p->bondsize < f->nbonds) {
+    p->bondsize = f->nbonds;
+    p->bonds = realloc(p->bonds, p->bondsize*sizeof(struct segment));
+    if(p->bonds == NULL) {
+      fprintf(stderr, "Error: unable to allocate memory for %d bonds.\n", f->nbonds);
+      exit(-1);
+    }
+  }
+
+  p->nbonds = 0;
+  for(i = 0; i < f->nbonds; i++) {
+    b = p->bonds + p->nbonds;
+    for(e = 0; e < 2; e++) {
+      k = f->bonds[2*i + e];
+      if(k < 0 || k >= f->n) break;
+      r[0] = f->x[k] - cam->location[0];
+      r[1] = f->y[k] - cam->location[1];
+      r[2] = f->z[k] - cam->location[2];
+      b->depth[e] = dot(r, cam->direction)/3.732;
+      if(!(b->depth[e] > 1) || b->depth[e] - 1 >= far) break;
+      /* Centres rounded as those of the discs */
+      b->x[e] = (int) (0.5f*width*(1 + dot(r, cam->screenx)/b->depth[e]));
+      b->y[e] = (int) (0.5f*height*(1 - dot(r, cam->screeny)/b->depth[e]));
+      b->c[e] = f->c[k];
+    }
+    if(e < 2) continue;
+    if((b->x[1] - b->x[0])*(b->x[1] - b->x[0]) + (b->y[1] - b->y[0])*(b->y[1] - b->y[0]) < 1)
+      continue;
+    b->size = 0.5f*width*BOND_RADIUS*fminf(f->R[f->bonds[2*i]], f->R[f->bonds[2*i + 1]]);
+
+    bondbox(b, box);
+    if(box[2] < 1 || box[0] > width - 1 || box[3] < 1 || box[1] > height - 1) continue;
+    p->nbonds++;
+  }
+}
+
+/* Project the particles and bonds of a frame on the screen, leaving out
+   those that cannot be seen. If the frame has a grid, only the particles in
+   cells that reach into the view are tested. If the frame has more particles
+   per pixel than p->aggregate, sub-pixel particles are merged by pixel
+   (the sums are cleared again as they are drawn). */
+void project(struct frame * f, struct camera * cam, int width, int height,
+             struct projection * p)
+{
+  struct grid * g = &p->grid; /* Grid of the frame */
+  float far = FAR_PLANE*cam->distance; /* Depth of the background */
+  float plane[4][3], norm[4], scale[4]; /* Normals of the side planes of the view,
+                                           their lengths and radius scales */
+  float centre[3], depth; /* Centre of a cell relative to the camera, its depth */
+  bool merge = p->aggregate > 0 && f->n > p->aggregate*width*height; /* Merge particles */
+  int i, q, c, k; /* Indices */
+
+  if(p->size < f->n) {
+    p->size = f->n;
+    p->xs = realloc(p->xs, p->size*sizeof(int));
+    p->ys = realloc(p->ys, p->size*sizeof(int));
+    p->s = realloc(p->s, p->size*sizeof(int));
+    p->depth = realloc(p->depth, p->size*sizeof(float));
+    p->c = realloc(p->c, p->size*sizeof(int));
+    if(!p->xs || !p->ys || !p->s || !p->depth || !p->c) {
+      fprintf(stderr, "Error: unable to allocate memory for %d particles.\n", f->n);
+      exit(-1);
+    }
+  }
+
+  if(merge && (p->sumwidth != width || p->sumheight != height)) {
+    free(p->sums);
+    p->sums = calloc(width*height, sizeof(struct pixelsum));
+    if(p->sums == NULL) {
+      fprintf(stderr, "Error: unable to allocate memory for the image.\n");
+      exit(-1);
+    }
+    p->sumwidth = width;
+    p->sumheight = height;
+  }
+
+  projectbonds(f, cam, width, height, p);
+
+  p->n = p->merged = 0;
+  p->sorted = false;
+  if(g->n != f->n) { /* No grid: every particle */
+    for(k = 0; k < f->n; k++) projectparticle(f, cam, width, height, far, p, k, merge);
+    return;
+  }
+
+  /* Side planes, 2 pixels out: a particle at r is off the screen to the
+     right if r.(screenx - e direction/3.732) > R, and so on */
+  for(i = 0; i < 3; i++) {
+    plane[0][i] = cam->screenx[i] - (1 + 4.0f/width)*cam->direction[i]/3.732f;
+    plane[1][i] = -cam->screenx[i] - (1 + 4.0f/width)*cam->direction[i]/3.732f;
+    plane[2][i] = cam->screeny[i] - (1 + 4.0f/height)*cam->direction[i]/3.732f;
+    plane[3][i] = -cam->screeny[i] - (1 + 4.0f/height)*cam->direction[i]/3.732f;
+  }
+  for(q = 0; q < 4; q++) {
+    norm[q] = modulus(plane[q]);
+    scale[q] = (q < 2)?1:(float) width/height; /* Radii are scaled by the width */
+  }
+
+  for(c = 0; c < g->ncells; c++) {
+    if(g->start[c] == g->start[c + 1]) continue;
+
+    /* Skip the cell if the sphere around it lies out of the view */
+    k = c;
+    for(i = 0; i < 3; i++) {
+      centre[i] = g->lo[i] + (k%g->side + 0.5f)*g->cell[i] - cam->location[i];
+      k /= g->side;
+    }
+    depth = dot(centre, cam->direction)/3.732f;
+    if(depth + g->reach/3.732f <= 1 || depth - g->reach/3.732f - 1 >= far) continue;
+    for(q = 0; q < 4; q++)
+      if(dot(centre, plane[q]) - g->reach*norm[q] > scale[q]*g->rmax[c]) break;
+    if(q < 4) continue;
+
+    for(k = g->start[c]; k < g->start[c + 1]; k++)
+      projectparticle(&g->sorted, cam, width, height, far, p, k, merge);
+  }
+}
+
+/* Sort the projected particles front to back (a stable radix sort on the bits
+   of the depths, which are positive floats and so sort like integers) */
+void sortprojection(struct projection * p)
+{
+  uint32_t * key[2]; /* Sort keys (source and destination of a pass) */
+  int * order[2]; /* Particle order (source and destination of a pass) */
+  int count[3][2048]; /* Histograms of the three 11-bit digits */
+  int * tmp; /* Reordered array */
+  int * field[4] = {p->xs, p->ys, p->s, p->c}; /* Integer arrays */
+  int n = p->n, pass, src = 0, digit, sum, i, k; /* Indices */
+
+  if(p->sortsize < n) {
+    p->sortsize = p->size;
+    p->keys = realloc(p->keys, 2*p->sortsize*sizeof(uint32_t));
+    p->order = realloc(p->order, 2*p->sortsize*sizeof(int));
+    if(p->keys == NULL || p->order == NULL) {
+      fprintf(stderr, "Error: unable to allocate memory for %d particles.\n", n);
+      exit(-1);
+    }
+  }
+  key[0] = p->keys; key[1] = p->keys + n;
+  order[0] = p->order; order[1] = p->order + n;
+
+  memset(count, 0, sizeof(count));
+  for(k = 0; k < n; k++) {
+    memcpy(&key[0][k], &p->depth[k], sizeof(uint32_t));
+    order[0][k] = k;
+    for(pass = 0; pass < 3; pass++) count[pass][(key[0][k] >> 11*pass) & 2047]++;
+  }
+
+  for(pass = 0; pass < 3; pass++) {
+    if(n == 0 || count[pass][(key[src][0] >> 11*pass) & 2047] == n)
+      continue; /* Every particle has the same digit */
+    for(sum = 0, i = 0; i < 2048; i++) {
+      digit = count[pass][i];
+      count[pass][i] = sum;
+      sum += digit;
+    }
+    for(k = 0; k < n; k++) {
+      i = count[pass][(key[src][k] >> 11*pass) & 2047]++;
+      key[1 - src][i] = key[src][k];
+      order[1 - src][i] = order[src][k];
+    }
+    src = 1 - src;
+  }
+
+  /* Reorder the particles, through the free key buffer (the sorted keys are
+     the depths) */
+  tmp = (int *) key[1 - src];
+  for(i = 0; i < 4; i++) {
+    for(k = 0; k < n; k++) tmp[k] = field[i][order[src][k]];
+    memcpy(field[i], tmp, n*sizeof(int));
+  }
+  memcpy(p->depth, key[src], n*sizeof(float));
+  p->sorted = true;
+}
+
+/* Copy the pixels into an X image that cannot be written directly */
+void updateimage(struct raster * r)
+{
+  int i, j; /* Pixel coordinates */
+
+  if(r->I == NULL) return;
+  for(j = 0; j < r->height; j++)
+    for(i = 0; i < r->width; i++)
+      XPutPixel(r->I, i, j, r->pixels[r->stride*j + i]);
+}
+
+/* Fill the image with the background colour and the z-buffer with the
+   maximum depth, in a single pass over the rows */
+void clearraster(struct raster * r, int background, float far)
+{
+  int i, j; /* Pixel coordinates */
+  int colour; /* Background colour of a row */
+  float * zrow; /* Z-buffer row */
+  uint32_t * prow; /* Image row */
+
+  for(j = 0; j < r->height; j++) {
+    colour = background;
+    # ifdef HORIZON_COLOUR
+    if(j > r->height/2) colour = HORIZON_COLOUR;
+    # endif
+
+    /* Simple loops, vectorised by the compiler */
+    zrow = r->zbuffer + r->width*j;
+    for(i = 0; i < r->width; i++) zrow[i] = far;
+    prow = r->pixels + r->stride*j;
+    for(i = 0; i < r->width; i++) prow[i] = colour;
+  }
+
+  /* Occlusion buffer */
+  for(i = 0; i < r->nbx*r->nby; i++) r->blockmax[i] = far;
+  for(i = 0; i < r->ntx*r->nty; i++) r->tilemax[i] = far;
+  memset(r->blockstale, 0, r->nbx*r->nby);
+  memset(r->tilestale, 0, r->ntx*r->nty);
+}
+
+/* Copy the image as packed native-endian 32-bit pixels (rgb32 video) */
+void copypixels(struct raster * r, uint32_t * buffer)
+{
+  int j; /* Row */
+
+  if(r->stride == r->width) /* The whole image at once */
+    memcpy(buffer, r->pixels, r->width*r->height*sizeof(uint32_t));
+  else
+    for(j = 0; j < r->height; j++)
+      memcpy(buffer + r->width*j, r->pixels + r->stride*j, r->width*sizeof(uint32_t));
+}
+
+/* Half width of the row j of a disc of radius s (i*i + j*j <= s*s) */
+static __inline__ int halfwidth(int s, int j)
+{
+  int w = (int) sqrtf((float) (s*s - j*j)); /* Half width */
+
+  while((w + 1)*(w + 1) + j*j <= s*s) w++;
+  while(w*w + j*j > s*s) w--;
+
+  return w;
+}
+
+/* Light angle factor at a distance sqrt(q) from the centre of a disc */
+static __inline__ float lightangle(int q, int s)
+{
+  # ifdef FAST_MATH
+  float lighting = s?1.0f - q/(2.0f*s*s):1.0f;
+  # else
+  float lighting = s?sqrtf(1.0f - (float) q/(s*s)):1.0f;
+  # endif
+  if(lighting > 1) lighting = 1.0f;
+
+  return lighting;
+}
+
+/* Lighting profile of the disc of radius s */
+struct profile * makeprofile(int s)
+{
+  struct profile * prof; /* Profile */
+  float * light; /* Lighting values */
+  int i, j, n = 0; /* Indices, number of values */
+
+  prof = malloc(sizeof(struct profile));
+  if(prof == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for lighting profiles.\n");
+    exit(-1);
+  }
+  prof->w = malloc((s + 1)*sizeof(int));
+  prof->row = malloc((s + 1)*sizeof(float *));
+  if(prof->w == NULL || prof->row == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for lighting profiles.\n");
+    exit(-1);
+  }
+  for(j = 0; j <= s; j++) {
+    prof->w[j] = halfwidth(s, j);
+    n += 2*prof->w[j] + 1;
+  }
+  light = malloc(n*sizeof(float));
+  if(light == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for lighting profiles.\n");
+    exit(-1);
+  }
+
+  for(j = 0; j <= s; j++) {
+    prof->row[j] = light + prof->w[j]; /* Centre of the row */
+    for(i = -prof->w[j]; i <= prof->w[j]; i++)
+      prof->row[j][i] = lightangle(i*i + j*j, s);
+    light += 2*prof->w[j] + 1;
+  }
+
+  return prof;
+}
+
+/* Shade a horizontal span of n pixels of a particle, given the light angle
+   factor of each pixel: scalar version */
+int shadescalar(float * zrow, uint32_t * prow, const float * light, int n,
+                float depth, float fade, const float c[3])
+{
+  int i; /* Pixel */
+  int visible = 0; /* Pixels passing the depth test */
+  float lighting; /* Light factor */
+
+  for(i = 0; i < n; i++) {
+    lighting = light[i];
+    if(zrow[i] > depth - lighting) { /* Check whether point is visible */
+      visible++;
+      zrow[i] = depth - lighting;
+      lighting *= fade; /* Modify colour by depth */
+      if(lighting < 0.0f) lighting = 0.0f;
+      prow[i] = (int) (c[0]*lighting)*65536 + (int) (c[1]*lighting)*256 + (int) (c[2]*lighting); /* Draw point */
+    }
+  }
+
+  return visible;
+}
+
+# ifdef SIMD
+/* Shade a span of pixels, four at a time (SSE2) */
+__attribute__((target("sse2")))
+int shadesse2(float * zrow, uint32_t * prow, const float * light, int n,
+              float depth, float fade, const float c[3])
+{
+  __m128 vdepth = _mm_set1_ps(depth), vfade = _mm_set1_ps(fade);
+  __m128 vr = _mm_set1_ps(c[0]), vg = _mm_set1_ps(c[1]), vb = _mm_set1_ps(c[2]);
+  __m128 zero = _mm_setzero_ps();
+  __m128 lighting, z, zold, visible; /* Light factors, depths, visible pixels */
+  __m128i colour, pold; /* Pixel colours */
+  __m128i count = _mm_setzero_si128(); /* Visible pixels (minus, in each lane) */
+  int i; /* Pixel */
+
+  for(i = 0; i + 4 <= n; i += 4) {
+    lighting = _mm_loadu_ps(light + i);
+    z = _mm_sub_ps(vdepth, lighting);
+    zold = _mm_loadu_ps(zrow + i);
+    visible = _mm_cmpgt_ps(zold, z);
+    count = _mm_sub_epi32(count, _mm_castps_si128(visible));
+    _mm_storeu_ps(zrow + i, _mm_or_ps(_mm_and_ps(visible, z), _mm_andnot_ps(visible, zold)));
+
+    lighting = _mm_max_ps(_mm_mul_ps(lighting, vfade), zero);
+    colour = _mm_add_epi32(_mm_add_epi32(
+               _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(vr, lighting)), 16),
+               _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(vg, lighting)), 8)),
+               _mm_cvttps_epi32(_mm_mul_ps(vb, lighting)));
+    pold = _mm_loadu_si128((__m128i *) (prow + i));
+    _mm_storeu_si128((__m128i *) (prow + i),
+                     _mm_or_si128(_mm_and_si128(_mm_castps_si128(visible), colour),
+                                  _mm_andnot_si128(_mm_castps_si128(visible), pold)));
+  }
+
+  count = _mm_add_epi32(count, _mm_shuffle_epi32(count, 0x4E));
+  count = _mm_add_epi32(count, _mm_shuffle_epi32(count, 0xB1));
+  return _mm_cvtsi128_si32(count)
+         + shadescalar(zrow + i, prow + i, light + i, n - i, depth, fade, c);
+}
+
+/* Shade a span of pixels, eight at a time (AVX2) */
+__attribute__((target("avx2")))
+int shadeavx2(float * zrow, uint32_t * prow, const float * light, int n,
+              float depth, float fade, const float c[3])
+{
+  __m256 vdepth = _mm256_set1_ps(depth), vfade = _mm256_set1_ps(fade);
+  __m256 vr = _mm256_set1_ps(c[0]), vg = _mm256_set1_ps(c[1]), vb = _mm256_set1_ps(c[2]);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 lighting, z, zold, visible; /* Light factors, depths, visible pixels */
+  __m256i colour, pold; /* Pixel colours */
+  __m256i count = _mm256_setzero_si256(); /* Visible pixels (minus, in each lane) */
+  __m128i sum; /* Sum of the lanes */
+  int visiblecount; /* Visible pixels in the AVX2 part */
+  int i; /* Pixel */
+
+  for(i = 0; i + 8 <= n; i += 8) {
+    lighting = _mm256_loadu_ps(light + i);
+    z = _mm256_sub_ps(vdepth, lighting);
+    zold = _mm256_loadu_ps(zrow + i);
+    visible = _mm256_cmp_ps(zold, z, _CMP_GT_OQ);
+    count = _mm256_sub_epi32(count, _mm256_castps_si256(visible));
+    _mm256_storeu_ps(zrow + i, _mm256_blendv_ps(zold, z, visible));
+
+    lighting = _mm256_max_ps(_mm256_mul_ps(lighting, vfade), zero);
+    colour = _mm256_add_epi32(_mm256_add_epi32(
+               _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(vr, lighting)), 16),
+               _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(vg, lighting)), 8)),
+               _mm256_cvttps_epi32(_mm256_mul_ps(vb, lighting)));
+    pold = _mm256_loadu_si256((__m256i *) (prow + i));
+    _mm256_storeu_si256((__m256i *) (prow + i),
+                        _mm256_blendv_epi8(pold, colour, _mm256_castps_si256(visible)));
+  }
+
+  sum = _mm_add_epi32(_mm256_castsi256_si128(count), _mm256_extracti128_si256(count, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+  visiblecount = _mm_cvtsi128_si32(sum);
+
+  /* Clear the upper halves of the AVX registers before the SSE2 code (which
+     would otherwise pay for every switch between the two on each span) */
+  _mm256_zeroupper();
+  return visiblecount + shadesse2(zrow + i, prow + i, light + i, n - i, depth, fade, c);
+}
+# endif
+
+/* Choose the fastest span kernel the processor supports */
+void selectkernel(struct raster * r)
+{
+  r->shade = shadescalar;
+  r->kernel = "scalar";
+  # ifdef SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    r->shade = shadeavx2;
+    r->kernel = "AVX2";
+  }
+  else if(__builtin_cpu_supports("sse2")) {
+    r->shade = shadesse2;
+    r->kernel = "SSE2";
+  }
+  # endif
+}
+
+/* Recompute the largest depth in block (bx, by), leaving out the first row
+   and column of the screen, which are never drawn */
+static __inline__ void refreshblock(struct raster * r, int bx, int by)
+{
+  int i0 = (bx*BLOCK > 1)?bx*BLOCK:1, i1 = (bx + 1)*BLOCK; /* Columns */
+  int j0 = (by*BLOCK > 1)?by*BLOCK:1, j1 = (by + 1)*BLOCK; /* Rows */
+  float z = 0; /* Largest depth */
+  float * zrow; /* Z-buffer row */
+  int i, j; /* Pixel coordinates */
+
+  if(i1 > r->width) i1 = r->width;
+  if(j1 > r->height) j1 = r->height;
+  for(j = j0; j < j1; j++) {
+    zrow = r->zbuffer + r->width*j;
+    for(i = i0; i < i1; i++) z = (zrow[i] > z)?zrow[i]:z;
+  }
+  r->blockmax[r->nbx*by + bx] = z;
+  r->blockstale[r->nbx*by + bx] = 0;
+  r->tilestale[r->ntx*(by*BLOCK/TILE) + bx*BLOCK/TILE] = 1; /* May tighten now */
+}
+
+/* Recompute the bound of tile t from those of its blocks */
+static __inline__ void refreshtile(struct raster * r, int t)
+{
+  int bx0 = (t%r->ntx)*(TILE/BLOCK), by0 = (t/r->ntx)*(TILE/BLOCK); /* First block */
+  int bx1 = bx0 + TILE/BLOCK, by1 = by0 + TILE/BLOCK; /* Last blocks */
+  float z = 0; /* Largest depth */
+  int bx, by; /* Block coordinates */
+
+  if(bx1 > r->nbx) bx1 = r->nbx;
+  if(by1 > r->nby) by1 = r->nby;
+  for(by = by0; by < by1; by++)
+    for(bx = bx0; bx < bx1; bx++)
+      z = (r->blockmax[r->nbx*by + bx] > z)?r->blockmax[r->nbx*by + bx]:z;
+  r->tilemax[t] = z;
+  r->tilestale[t] = 0;
+}
+
+/* Whether a disc closest at depth zmin is hidden everywhere in the pixel
+   rectangle [x0, x1]x[y0, y1]: tiles, then 8x8 blocks, whose largest depth
+   is not beyond zmin. The bounds only go down as discs are drawn, so stale
+   ones are still bounds, and are only recomputed when they are too high. */
+static __inline__ bool hidden(struct raster * r, int x0, int y0, int x1, int y1, float zmin)
+{
+  int tx, ty, bx, by, t, b; /* Tile and block coordinates and indices */
+  int i0, i1, j0, j1; /* Part of the rectangle in a tile */
+
+  for(ty = y0/TILE; ty <= y1/TILE; ty++)
+    for(tx = x0/TILE; tx <= x1/TILE; tx++) {
+      t = r->ntx*ty + tx;
+      if(r->tilemax[t] > zmin && r->tilestale[t]) refreshtile(r, t);
+      if(r->tilemax[t] <= zmin) continue;
+
+      i0 = (x0 > tx*TILE)?x0:tx*TILE;
+      i1 = (x1 < (tx + 1)*TILE - 1)?x1:(tx + 1)*TILE - 1;
+      j0 = (y0 > ty*TILE)?y0:ty*TILE;
+      j1 = (y1 < (ty + 1)*TILE - 1)?y1:(ty + 1)*TILE - 1;
+      for(by = j0/BLOCK; by <= j1/BLOCK; by++)
+        for(bx = i0/BLOCK; bx <= i1/BLOCK; bx++) {
+          b = r->nbx*by + bx;
+          if(r->blockmax[b] > zmin && r->blockstale[b]) refreshblock(r, bx, by);
+          if(r->blockmax[b] > zmin) return false;
+        }
+    }
+
+  return true;
+}
+
+/* Mark the bounds of the pixel rectangle [x0, x1]x[y0, y1] as stale */
+static __inline__ void staleblocks(struct raster * r, int x0, int y0, int x1, int y1)
+{
+  int bx, by, tx, ty; /* Block and tile coordinates */
+
+  for(by = y0/BLOCK; by <= y1/BLOCK; by++)
+    for(bx = x0/BLOCK; bx <= x1/BLOCK; bx++) r->blockstale[r->nbx*by + bx] = 1;
+  for(ty = y0/TILE; ty <= y1/TILE; ty++)
+    for(tx = x0/TILE; tx <= x1/TILE; tx++) r->tilestale[r->ntx*ty + tx] = 1;
+}
+
+/* Light factor of a particle at a given depth, dimmed as it moves away */
+static __inline__ float fading(struct raster * r, float depth)
+{
+  # ifndef NO_FADING
+  return 1.0f - r->fade*(depth - 1.0f)/(0.5f*r->backdrop - 1.0f);
+  # else
+  return 1.0f;
+  # endif
+}
+
+/* Draw the merged sub-pixel particles inside the rectangle [x0, x1)x[y0, y1),
+   each pixel with the average colour of its particles, at the depth of the
+   nearest one, and clear the sums for the next frame */
+static __inline__ void drawsums(struct raster * r, int x0, int y0, int x1, int y1,
+                                long count[4])
+{
+  struct pixelsum * sum; /* Merged particles on a row */
+  float * zrow; /* Z-buffer row */
+  uint32_t * prow; /* Image row */
+  float lighting; /* Light factor (over the number of particles) */
+  uint64_t rgb; /* Colour sums */
+  long visible = count[1]; /* Visible pixels before */
+  int i, j; /* Pixel coordinates */
+
+  for(j = y0; j < y1; j++) {
+    sum = r->p->sums + r->width*(j + r->top);
+    zrow = r->zbuffer + r->width*j;
+    prow = r->pixels + r->stride*j;
+    for(i = x0; i < x1; i++) {
+      if(sum[i].n == 0) continue;
+      count[0]++;
+      if(zrow[i] > sum[i].depth - 1.0f) {
+        count[1]++;
+        zrow[i] = sum[i].depth - 1.0f;
+        lighting = fading(r, sum[i].depth);
+        lighting = (lighting > 0.0f)?lighting/((sum[i].n < PIXELSUM_MAX)?sum[i].n:PIXELSUM_MAX):0;
+        rgb = sum[i].rgb;
+        prow[i] = (int) ((rgb >> 42)*lighting)*65536
+                  + (int) ((rgb >> 21 & 0x1FFFFF)*lighting)*256 + (int) ((rgb & 0x1FFFFF)*lighting);
+      }
+      sum[i].n = 0;
+      sum[i].rgb = 0;
+    }
+  }
+
+  if(r->occlusion && count[1] > visible) staleblocks(r, x0, y0, x1 - 1, y1 - 1);
+}
+
+/* Draw the part of particle k that lies inside the rectangle [x0, x1)x[y0, y1),
+   adding the depth tests, visible pixels, discs and hidden discs to count
+   (the last two with occlusion culling) */
+static __inline__ void drawdisc(struct raster * r, int k, int x0, int y0, int x1, int y1,
+                                long count[4])
+{
+  struct projection * p = r->p; /* Projected particles */
+  int xs = p->xs[k], ys = p->ys[k] - r->top, s = p->s[k]; /* Image coordinates */
+  float depth = p->depth[k]; /* Depth of particle */
+  float c[3] = {p->c[k]/65536, (p->c[k]/256)%256, p->c[k]%256}; /* Colour */
+  float fade = fading(r, depth); /* Dimming with depth */
+  struct profile * prof = (s >= 0 && s <= PROFILE_MAX)?r->profiles[s]:NULL; /* Lighting */
+  float light[TILE]; /* Light factors of large discs */
+  int imin, imax, jmin, jmax; /* Part of the disc in the rectangle */
+  int i0, i1, w; /* Span of the disc on a row, half width */
+  int i, j, n; /* Pixel offsets, pixels in a piece of span */
+  long visible = count[1]; /* Visible pixels before this disc */
+  float * zrow; /* Z-buffer row */
+  uint32_t * prow; /* Image row */
+
+  if(s == 0) { /* Sub-pixel particle: a single pixel, shaded as a disc centre */
+    if(xs < x0 || xs >= x1 || ys < y0 || ys >= y1) return;
+    zrow = r->zbuffer + r->width*ys + xs;
+    prow = r->pixels + r->stride*ys + xs;
+    count[0]++;
+    if(*zrow > depth - 1.0f) {
+      count[1]++;
+      *zrow = depth - 1.0f;
+      if(fade < 0.0f) fade = 0.0f;
+      *prow = (int) (c[0]*fade)*65536 + (int) (c[1]*fade)*256 + (int) (c[2]*fade);
+      if(r->occlusion) staleblocks(r, xs, ys, xs, ys);
+    }
+    return;
+  }
+
+  imin = (x0 - xs > -s)?x0 - xs:-s;
+  imax = (x1 - 1 - xs < s)?x1 - 1 - xs:s;
+  jmin = (y0 - ys > -s)?y0 - ys:-s;
+  jmax = (y1 - 1 - ys < s)?y1 - 1 - ys:s;
+
+  if(r->occlusion && imin <= imax && jmin <= jmax) { /* Skip hidden discs */
+    count[2]++;
+    if(hidden(r, xs + imin, ys + jmin, xs + imax, ys + jmax, depth - 1)) {
+      count[3]++;
+      return;
+    }
+  }
+
+  for(j = jmin; j <= jmax; j++) {
+    /* Only paint points on a circle */
+    w = prof?prof->w[abs(j)]:halfwidth(s, j);
+    i0 = (imin > -w)?imin:-w;
+    i1 = (imax < w)?imax:w;
+    if(i0 > i1) continue;
+
+    zrow = r->zbuffer + r->width*(ys + j) + xs;
+    prow = r->pixels + r->stride*(ys + j) + xs;
+    count[0] += i1 - i0 + 1;
+
+    if(prof) /* Light factors from the profile */
+      count[1] += r->shade(zrow + i0, prow + i0, prof->row[abs(j)] + i0, i1 - i0 + 1,
+                           depth, fade, c);
+    else /* Light factors computed in pieces */
+      for(; i0 <= i1; i0 += n) {
+        n = (i1 - i0 + 1 < TILE)?i1 - i0 + 1:TILE;
+        for(i = 0; i < n; i++) light[i] = lightangle((i0 + i)*(i0 + i) + j*j, s);
+        count[1] += r->shade(zrow + i0, prow + i0, light, n, depth, fade, c);
+      }
+  }
+
+  if(r->occlusion && count[1] > visible)
+    staleblocks(r, xs + imin, ys + jmin, xs + imax, ys + jmax);
+}
+
+/* Draw the part of bond b that lies inside the rectangle [x0, x1)x[y0, y1):
+   a cylinder between the centres of its particles, each half in the colour of
+   its particle, shaded across as the discs are, at depths interpolated with
+   perspective along it */
+static __inline__ void drawbond(struct raster * r, int k, int x0, int y0, int x1, int y1,
+                                long count[4])
+{
+  struct segment * b = r->p->bonds + k; /* Projected bond */
+  float ex = b->x[1] - b->x[0], ey = b->y[1] - b->y[0]; /* Screen axis */
+  float length2 = ex*ex + ey*ey; /* Squared length on the screen */
+  float inverse[2] = {1/b->depth[0], 1/b->depth[1]}; /* Inverse depths of the ends */
+  float c[2][3]; /* Colours */
+  float dx, dy, t, d2; /* Pixel from the first end, position along the axis, squared
+                          distance from it */
+  float depth, w, lighting; /* Depth of the axis, half width, light factor */
+  int box[4]; /* Screen box */
+  int i, j, e; /* Pixel, end */
+  float * zrow; /* Z-buffer row */
+  uint32_t * prow; /* Image row */
+
+  for(e = 0; e < 2; e++) {
+    c[e][0] = b->c[e]/65536;
+    c[e][1] = (b->c[e]/256)%256;
+    c[e][2] = b->c[e]%256;
+  }
+  bondbox(b, box);
+  box[1] -= r->top;
+  box[3] -= r->top;
+  if(box[0] < x0) box[0] = x0;
+  if(box[1] < y0) box[1] = y0;
+  if(box[2] > x1 - 1) box[2] = x1 - 1;
+  if(box[3] > y1 - 1) box[3] = y1 - 1;
+
+  for(j = box[1]; j <= box[3]; j++) {
+    zrow = r->zbuffer + r->width*j;
+    prow = r->pixels + r->stride*j;
+    dy = j + r->top - b->y[0];
+    for(i = box[0]; i <= box[2]; i++) {
+      dx = i - b->x[0];
+      t = (dx*ex + dy*ey)/length2;
+      if(t < 0 || t > 1) continue; /* The ends are inside the particles */
+      depth = 1/(inverse[0] + t*(inverse[1] - inverse[0]));
+      w = b->size/depth;
+      d2 = (dx*ey - dy*ex)*(dx*ey - dy*ex)/length2;
+      if(d2 > w*w) continue;
+      count[0]++;
+
+      lighting = sqrtf(1.0f - d2/(w*w));
+      if(zrow[i] > depth - BOND_RADIUS*lighting) {
+        count[1]++;
+        zrow[i] = depth - BOND_RADIUS*lighting;
+        e = (t*inverse[1]*depth > 0.5f); /* Half of the bond in space */
+        lighting *= fading(r, depth);
+        if(lighting < 0.0f) lighting = 0.0f;
+        prow[i] = (int) (c[e][0]*lighting)*65536 + (int) (c[e][1]*lighting)*256
+                  + (int) (c[e][2]*lighting);
+      }
+    }
+  }
+}
+
+/* Draw the particles overlapping tile t (a task of the raster r) */
+void drawtile(void * arg, int t)
+{
+  struct raster * r = arg; /* Rasteriser */
+  int x0, y0, x1, y1; /* Tile rectangle (leaving out the first row and column) */
+  int k; /* Index in the tile list */
+  long count[4] = {0, 0, 0, 0}; /* Depth tests, visible pixels, discs, hidden discs */
+
+  x0 = (t%r->ntx)*TILE; if(x0 < 1) x0 = 1;
+  y0 = (t/r->ntx)*TILE; if(y0 < 1) y0 = 1;
+  x1 = (t%r->ntx + 1)*TILE; if(x1 > r->width) x1 = r->width;
+  y1 = (t/r->ntx + 1)*TILE; if(y1 > r->height) y1 = r->height;
+
+  if(r->p->merged > 0) drawsums(r, x0, y0, x1, y1, count);
+  for(k = r->tilestart[t]; k < r->tilestart[t + 1]; k++)
+    if(r->tilelist[k] < r->p->n) drawdisc(r, r->tilelist[k], x0, y0, x1, y1, count);
+    else drawbond(r, r->tilelist[k] - r->p->n, x0, y0, x1, y1, count);
+
+  __sync_fetch_and_add(&r->tested, count[0]);
+  __sync_fetch_and_add(&r->visible, count[1]);
+  __sync_fetch_and_add(&r->discs, count[2]);
+  __sync_fetch_and_add(&r->occluded, count[3]);
+}
+
+/* Worker thread: run the tasks of each new job (drawing the tiles of a frame) */
+void * worker(void * arg)
+{
+  struct raster * r = arg; /* Rasteriser */
+  int job = 0; /* Last job run */
+  int t; /* Task */
+
+  pthread_mutex_lock(&r->lock);
+  for(;;) {
+    while(r->job == job) pthread_cond_wait(&r->start, &r->lock);
+    job = r->job;
+    pthread_mutex_unlock(&r->lock);
+
+    while((t = __sync_fetch_and_add(&r->nexttask, 1)) < r->ntasks)
+      r->task(r->arg, t);
+
+    pthread_mutex_lock(&r->lock);
+    if(--r->busy == 0) pthread_cond_signal(&r->done);
+  }
+
+  return NULL;
+}
+
+/* Draw into an X image, directly if the pixels can be written as 32-bit RGB
+   in host byte order, otherwise into a buffer copied with XPutPixel */
+void setimage(struct raster * r, XImage * I)
+{
+  union {uint32_t word; char byte;} endian = {1}; /* Host byte order */
+
+  if(I->bits_per_pixel == 32 && I->red_mask == 0xFF0000 && I->green_mask == 0xFF00
+     && I->blue_mask == 0xFF && I->byte_order == (endian.byte?LSBFirst:MSBFirst)) {
+    r->I = NULL;
+    r->pixels = (uint32_t *) I->data;
+    r->stride = I->bytes_per_line/4;
+  }
+  else {
+    if(r->copy == NULL) {
+      r->copy = alignedalloc(r->width*r->height*sizeof(uint32_t));
+      if(r->copy == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for the image.\n");
+        exit(-1);
+      }
+    }
+    r->I = I;
+    r->pixels = r->copy;
+    r->stride = r->width;
+  }
+}
+
+/* Set the size of the image and z-buffer. Without an X image, the rasteriser
+   draws into the given buffer of 32-bit RGB pixels. Call it only between
+   frames. */
+void resizeraster(struct raster * r, XImage * I, uint32_t * buffer, float * zbuffer,
+                  int width, int height)
+{
+  free(r->copy);
+  r->copy = NULL;
+  r->I = NULL;
+  r->pixels = buffer;
+  r->stride = width;
+  r->zbuffer = zbuffer;
+  r->width = width;
+  r->height = height;
+  if(I != NULL) setimage(r, I);
+
+  free(r->tilestart);
+  r->ntx = (width + TILE - 1)/TILE;
+  r->nty = (height + TILE - 1)/TILE;
+  r->tilestart = calloc(r->ntx*r->nty + 1, sizeof(int));
+  if(r->tilestart == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for screen tiles.\n");
+    exit(-1);
+  }
+
+  /* Occlusion buffer (cleared with the z-buffer) */
+  free(r->blockmax);
+  free(r->blockstale);
+  free(r->tilemax);
+  free(r->tilestale);
+  r->nbx = (width + BLOCK - 1)/BLOCK;
+  r->nby = (height + BLOCK - 1)/BLOCK;
+  r->blockmax = malloc(r->nbx*r->nby*sizeof(float));
+  r->blockstale = calloc(r->nbx*r->nby, 1);
+  r->tilemax = malloc(r->ntx*r->nty*sizeof(float));
+  r->tilestale = calloc(r->ntx*r->nty, 1);
+  if(!r->blockmax || !r->blockstale || !r->tilemax || !r->tilestale) {
+    fprintf(stderr, "Error: unable to allocate memory for the occlusion buffer.\n");
+    exit(-1);
+  }
+}
+
+/* Set up the rasteriser and start its worker threads */
+void startraster(struct raster * r, XImage * I, uint32_t * buffer, float * zbuffer,
+                 int width, int height, int nthreads)
+{
+  int i; /* Thread index */
+
+  r->copy = NULL;
+  r->tilestart = NULL;
+  r->blockmax = r->tilemax = NULL;
+  r->blockstale = r->tilestale = NULL;
+  r->occlusion = false;
+  r->top = 0;
+  resizeraster(r, I, buffer, zbuffer, width, height);
+  for(i = 0; i <= PROFILE_MAX; i++) r->profiles[i] = NULL;
+  selectkernel(r);
+  r->nthreads = (nthreads > 0)?nthreads:1;
+  r->tilelist = NULL;
+  r->listsize = 0;
+  r->job = r->busy = 0;
+
+  if(r->nthreads == 1) return;
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->start, NULL);
+  pthread_cond_init(&r->done, NULL);
+  r->workers = malloc((r->nthreads - 1)*sizeof(pthread_t));
+  for(i = 0; i < r->nthreads - 1; i++)
+    if(r->workers == NULL || pthread_create(&r->workers[i], NULL, worker, r)) {
+      fprintf(stderr, "Error: unable to start drawing threads.\n");
+      exit(-1);
+    }
+}
+
+/* Run n tasks on the threads of the raster (task(arg, t) for t = 0 to n - 1),
+   returning when all of them are done */
+void runtasks(struct raster * r, void (* task)(void *, int), void * arg, int n)
+{
+  int t; /* Task */
+
+  if(r->nthreads == 1) {
+    for(t = 0; t < n; t++) task(arg, t);
+    return;
+  }
+
+  /* Hand the tasks to the workers and run some of them here too */
+  pthread_mutex_lock(&r->lock);
+  r->task = task;
+  r->arg = arg;
+  r->ntasks = n;
+  r->nexttask = 0;
+  r->busy = r->nthreads - 1;
+  r->job++;
+  pthread_cond_broadcast(&r->start);
+  pthread_mutex_unlock(&r->lock);
+
+  while((t = __sync_fetch_and_add(&r->nexttask, 1)) < n) task(arg, t);
+
+  pthread_mutex_lock(&r->lock);
+  while(r->busy > 0) pthread_cond_wait(&r->done, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* Draw projected particles. With several threads, particles are sorted into
+   screen tiles, which the threads draw independently. Within a tile,
+   particles are drawn in file order, so the image is the same either way.
+   With occlusion culling, they are sorted front to back first (unless they
+   already are since they were projected), and discs hidden by those already
+   drawn are skipped. */
+void render(struct raster * r, struct projection * p)
+{
+  int ntiles = r->ntx*r->nty; /* Number of tiles */
+  int tx0, ty0, tx1, ty1; /* Tiles overlapped by a particle */
+  int box[4]; /* Screen box of a particle or bond */
+  int tx, ty, k, t; /* Indices */
+  int pass; /* Count tile entries, then fill the lists */
+  long count[4] = {0, 0, 0, 0}; /* Depth tests, visible pixels, discs, hidden discs */
+
+  r->p = p;
+  r->tested = r->visible = r->discs = r->occluded = 0;
+  if(r->occlusion && !p->sorted) sortprojection(p);
+
+  /* Lighting profiles for the radii in this frame */
+  for(k = 0; k < p->n; k++)
+    if(p->s[k] >= 0 && p->s[k] <= PROFILE_MAX && r->profiles[p->s[k]] == NULL)
+      r->profiles[p->s[k]] = makeprofile(p->s[k]);
+
+  if(r->nthreads == 1) { /* Serial path: the whole screen in a single tile */
+    if(p->merged > 0) drawsums(r, 1, 1, r->width, r->height, count);
+    for(k = 0; k < p->n; k++) drawdisc(r, k, 1, 1, r->width, r->height, count);
+    for(k = 0; k < p->nbonds; k++) drawbond(r, k, 1, 1, r->width, r->height, count);
+    r->tested = count[0];
+    r->visible = count[1];
+    r->discs = count[2];
+    r->occluded = count[3];
+    return;
+  }
+
+  /* Sort particles, and then bonds, into tiles by bounding box */
+  for(t = 0; t <= ntiles; t++) r->tilestart[t] = 0;
+  for(pass = 0; pass < 2; pass++) {
+    for(k = 0; k < p->n + p->nbonds; k++) {
+      if(k < p->n) {
+        box[0] = p->xs[k] - p->s[k];
+        box[1] = p->ys[k] - p->s[k];
+        box[2] = p->xs[k] + p->s[k];
+        box[3] = p->ys[k] + p->s[k];
+      }
+      else bondbox(p->bonds + k - p->n, box);
+      box[1] -= r->top;
+      box[3] -= r->top;
+      tx0 = (box[0] < 1)?1:box[0];
+      ty0 = (box[1] < 1)?1:box[1];
+      tx1 = (box[2] > r->width - 1)?r->width - 1:box[2];
+      ty1 = (box[3] > r->height - 1)?r->height - 1:box[3];
+      if(tx0 > tx1 || ty0 > ty1) continue; /* Off screen */
+
+      for(ty = ty0/TILE; ty <= ty1/TILE; ty++)
+        for(tx = tx0/TILE; tx <= tx1/TILE; tx++) {
+          if(pass == 0) r->tilestart[ty*r->ntx + tx + 1]++;
+          else r->tilelist[r->tilestart[ty*r->ntx + tx]++] = k;
+        }
+    }
+
+    if(pass == 0) { /* Beginning of each list */
+      for(t = 0; t < ntiles; t++) r->tilestart[t + 1] += r->tilestart[t];
+      if(r->listsize < r->tilestart[ntiles]) {
+        r->listsize = r->tilestart[ntiles];
+        r->tilelist = realloc(r->tilelist, r->listsize*sizeof(int));
+        if(r->tilelist == NULL) {
+          fprintf(stderr, "Error: unable to allocate memory for screen tiles.\n");
+          exit(-1);
+        }
+      }
+    }
+    else { /* Filling the lists moved each beginning to the next one */
+      for(t = ntiles; t > 0; t--) r->tilestart[t] = r->tilestart[t - 1];
+      r->tilestart[0] = 0;
+    }
+  }
+
+  runtasks(r, drawtile, r, ntiles);
+}
+
+/* Set up a supersampler drawing into the image of a raster with n x n samples
+   per pixel, filtered with a box (the average of the samples in the pixel) or
+   a tent (reaching the centres of the neighbouring pixels) */
+void startsupersampler(struct supersampler * ss, struct raster * image, int n, bool tent,
+                       int nthreads)
+{
+  float w; /* Filter weight */
+  int o, rows; /* Sample offset, sample rows in a band */
+
+  ss->image = image;
+  ss->n = n;
+  ss->weight = malloc(3*n*sizeof(float));
+  if(ss->weight == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the filter weights.\n");
+    exit(-1);
+  }
+  for(ss->lo = ss->hi = o = -n; o < 2*n; o++) { /* Offsets from the first sample */
+    w = tent?1.0f - fabsf(o + 0.5f - 0.5f*n)/n:(o >= 0 && o < n);
+    if(w <= 0) continue;
+    if(ss->hi == -n) ss->lo = o;
+    ss->weight[o - ss->lo] = w;
+    ss->hi = o + 1;
+  }
+
+  /* Bands of about BAND_SAMPLES samples, with the rows reached by the filter
+     around them and the first row (which is not drawn) */
+  ss->band = (BAND_SAMPLES/(n*image->width) - (ss->hi - ss->lo - n) - 1)/n;
+  if(ss->band < 1) ss->band = 1;
+  if(ss->band > image->height) ss->band = image->height;
+  rows = n*ss->band + ss->hi - ss->lo - n + 1;
+  ss->pixels = alignedalloc((long) n*image->width*rows*sizeof(uint32_t));
+  ss->zbuffer = alignedalloc((long) n*image->width*rows*sizeof(float));
+  if(ss->pixels == NULL || ss->zbuffer == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the samples.\n");
+    exit(-1);
+  }
+  startraster(&ss->r, NULL, ss->pixels, ss->zbuffer, n*image->width, rows, nthreads);
+}
+
+/* Filter the samples of image row t of the band into the image (a task of
+   the raster of the supersampler ss), leaving out those off the screen */
+void filterrow(void * arg, int t)
+{
+  struct supersampler * ss = arg; /* Supersampler */
+  struct raster * r = &ss->r; /* Rasteriser of the band */
+  int n = ss->n, y = ss->y0 + t; /* Samples per pixel across, image row */
+  int width = ss->image->width, height = ss->image->height; /* Size of the image */
+  int x, i, j, i0, i1, j0, j1; /* Pixel, sample offsets and their ranges */
+  float sum[3], total, w; /* Weighted sums of the colours and of the weights, weight */
+  uint32_t * row, c; /* Sample row, sample */
+
+  j0 = (ss->lo > -n*y)?ss->lo:-n*y;
+  j1 = (ss->hi < n*(height - y))?ss->hi:n*(height - y);
+  for(x = 0; x < width; x++) {
+    i0 = (ss->lo > -n*x)?ss->lo:-n*x;
+    i1 = (ss->hi < n*(width - x))?ss->hi:n*(width - x);
+    sum[0] = sum[1] = sum[2] = total = 0;
+    for(j = j0; j < j1; j++) {
+      row = r->pixels + r->stride*(n*y + j - r->top) + n*x;
+      for(i = i0; i < i1; i++) {
+        w = ss->weight[j - ss->lo]*ss->weight[i - ss->lo];
+        c = row[i];
+        sum[0] += w*(c >> 16 & 0xFF);
+        sum[1] += w*(c >> 8 & 0xFF);
+        sum[2] += w*(c & 0xFF);
+        total += w;
+      }
+    }
+    ss->image->pixels[ss->image->stride*y + x] = (int) (sum[0]/total + 0.5f)*65536
+      + (int) (sum[1]/total + 0.5f)*256 + (int) (sum[2]/total + 0.5f);
+  }
+}
+
+/* Draw projected particles into the image of a supersampler, band by band
+   (the particles are projected on a screen n times the width and height of the
+   image, and the fading, backdrop and occlusion flags are those of its raster) */
+void drawsupersampled(struct supersampler * ss, struct projection * p, int background,
+                      float far)
+{
+  struct raster * r = &ss->r, * image = ss->image; /* Rasterisers of a band, image */
+
+  r->fade = image->fade;
+  r->backdrop = image->backdrop;
+  r->occlusion = image->occlusion;
+  image->tested = image->visible = image->discs = image->occluded = 0;
+  if(r->occlusion) sortprojection(p); /* Once for every band */
+  for(ss->y0 = 0; ss->y0 < image->height; ss->y0 = ss->y1) {
+    ss->y1 = (ss->y0 + ss->band < image->height)?ss->y0 + ss->band:image->height;
+    r->top = ss->n*ss->y0 + ss->lo - 1;
+    clearraster(r, background, far);
+    render(r, p);
+    image->tested += r->tested;
+    image->visible += r->visible;
+    image->discs += r->discs;
+    image->occluded += r->occluded;
+    runtasks(r, filterrow, ss, ss->y1 - ss->y0);
+  }
+}
+
+/*** Image presentation ***/
+
+static bool shmfailed; /* An MIT-SHM request has failed */
+
+/* X error handler catching a failed shared memory attachment */
+int shmerror(Display * d, XErrorEvent * e)
+{
+  shmfailed = true;
+  return 0;
+}
+
+/* Create image b in a shared memory segment attached by the X server */
+bool createshmimage(struct screen * s, int b, int depth)
+{
+  XShmSegmentInfo * info = &s->shminfo[b]; /* Shared memory segment */
+  XImage * I; /* Image */
+  int (* handler)(Display *, XErrorEvent *); /* Previous error handler */
+
+  I = XShmCreateImage(s->d, DefaultVisual(s->d, 0), depth, ZPixmap, NULL, info,
+                      s->width, s->height);
+  if(I == NULL) return false;
+  info->shmid = shmget(IPC_PRIVATE, I->bytes_per_line*I->height, IPC_CREAT | 0600);
+  if(info->shmid < 0) {
+    XDestroyImage(I);
+    return false;
+  }
+  info->shmaddr = shmat(info->shmid, NULL, 0);
+  info->readOnly = False;
+
+  /* The X server cannot attach the segment if it runs on another machine */
+  shmfailed = (info->shmaddr == (char *) -1);
+  if(!shmfailed) {
+    XSync(s->d, False);
+    handler = XSetErrorHandler(shmerror);
+    XShmAttach(s->d, info);
+    XSync(s->d, False);
+    XSetErrorHandler(handler);
+  }
+  shmctl(info->shmid, IPC_RMID, NULL); /* Removed once detached */
+  if(shmfailed) {
+    if(info->shmaddr != (char *) -1) shmdt(info->shmaddr);
+    XDestroyImage(I);
+    return false;
+  }
+
+  I->data = info->shmaddr;
+  s->image[b] = I;
+  return true;
+}
+
+/* Create the window images: two in shared memory if the X server allows it
+   (one is drawn while the other is shown), otherwise a plain one sent with
+   XPutImage */
+void openscreen(struct screen * s, Display * d, Window w, GC g, int depth,
+                int width, int height, bool shm)
+{
+  char * buffer; /* Plain image data */
+
+  s->d = d;
+  s->w = w;
+  s->g = g;
+  s->width = width;
+  s->height = height;
+  s->nimages = 0;
+  s->back = 0;
+  s->pending[0] = s->pending[1] = false;
+  s->completion = -1;
+
+  if(shm && XShmQueryExtension(d))
+    while(s->nimages < 2 && createshmimage(s, s->nimages, depth)) s->nimages++;
+  s->shm = (s->nimages > 0);
+  if(s->shm) {
+    s->completion = XShmGetEventBase(d) + ShmCompletion;
+    return;
+  }
+
+  buffer = alignedalloc(width*height*sizeof(uint32_t));
+  if(buffer == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the image.\n");
+    exit(-1);
+  }
+  s->image[0] = XCreateImage(d, DefaultVisual(d, 0), depth, ZPixmap, 0, buffer,
+                             width, height, 32, 0);
+  s->nimages = 1;
+}
+
+/* Send the back image to the window */
+void showimage(struct screen * s)
+{
+  XImage * I = s->image[s->back]; /* Image */
+
+  if(s->shm) {
+    XShmPutImage(s->d, s->w, s->g, I, 0, 0, 0, 0, s->width, s->height, True);
+    s->pending[s->back] = true;
+  }
+  else
+    XPutImage(s->d, s->w, s->g, I, 0, 0, 0, 0, s->width, s->height);
+}
+
+/* Mark an image as read by the X server on its ShmCompletion event */
+void imagedone(struct screen * s, XEvent * e)
+{
+  int b; /* Image */
+
+  if(e->type != s->completion) return;
+  for(b = 0; b < s->nimages; b++)
+    if(((XShmCompletionEvent *) e)->shmseg == s->shminfo[b].shmseg)
+      s->pending[b] = false;
+}
+
+/* Event predicate for XIfEvent */
+Bool iscompletion(Display * d, XEvent * e, XPointer arg)
+{
+  return e->type == ((struct screen *) arg)->completion;
+}
+
+/* Move on to the next image, waiting until the X server has read it */
+XImage * nextimage(struct screen * s)
+{
+  XEvent e; /* ShmCompletion event */
+
+  s->back = (s->back + 1)%s->nimages;
+  while(s->pending[s->back]) {
+    XIfEvent(s->d, &e, iscompletion, (XPointer) s);
+    imagedone(s, &e);
+  }
+
+  return s->image[s->back];
+}
+
+/* Sleep until an X event arrives, for at most timeout seconds (if not negative) */
+void waitevent(Display * d, double timeout)
+{
+  int fd = ConnectionNumber(d); /* Connection to the X server */
+  fd_set fds; /* Descriptors to watch */
+  struct timeval tv; /* Timeout */
+
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+  tv.tv_sec = timeout;
+  tv.tv_usec = 1e6*(timeout - tv.tv_sec);
+  select(fd + 1, &fds, NULL, NULL, (timeout >= 0)?&tv:NULL);
+}
+
+/* Free the images */
+void closescreen(struct screen * s)
+{
+  int b; /* Image */
+
+  for(b = 0; b < s->nimages; b++) {
+    if(s->shm) {
+      XShmDetach(s->d, &s->shminfo[b]);
+      shmdt(s->shminfo[b].shmaddr);
+      s->image[b]->data = NULL;
+    }
+    XDestroyImage(s->image[b]);
+  }
+  s->nimages = 0;
+}
+
+/*** Image files ***/
+
+static uint32_t crctable[256]; /* CRC-32 of every byte value (for png chunks) */
+
+/* Fill the CRC-32 table */
+void makecrctable(void)
+{
+  uint32_t c; /* CRC */
+  int n, k; /* Byte value, bit */
+
+  for(n = 0; n < 256; n++) {
+    c = n;
+    for(k = 0; k < 8; k++) c = (c & 1)?0xEDB88320 ^ (c >> 1):c >> 1;
+    crctable[n] = c;
+  }
+}
+
+/* CRC-32 of a block of bytes */
+uint32_t crc32(const unsigned char * p, long n)
+{
+  uint32_t c = 0xFFFFFFFF; /* CRC */
+
+  while(n-- > 0) c = crctable[(c ^ *p++) & 0xFF] ^ (c >> 8);
+  return c ^ 0xFFFFFFFF;
+}
+
+/* Store a 32-bit integer in big-endian byte order */
+static __inline__ unsigned char * putbig(unsigned char * p, uint32_t x)
+{
+  *p++ = x >> 24;
+  *p++ = x >> 16;
+  *p++ = x >> 8;
+  *p++ = x;
+  return p;
+}
+
+/* Convert packed 32-bit pixels into 24-bit RGB */
+void rgbpixels(const uint32_t * pixels, long n, unsigned char * rgb)
+{
+  long i; /* Pixel */
+
+  for(i = 0; i < n; i++) {
+    *rgb++ = pixels[i] >> 16;
+    *rgb++ = pixels[i] >> 8;
+    *rgb++ = pixels[i];
+  }
+}
+
+/* Encode an image as a binary ppm file into a buffer of at least
+   3*width*height + 32 bytes (returns the size of the file) */
+long encodeppm(const uint32_t * pixels, int width, int height, unsigned char * out)
+{
+  int n = sprintf((char *) out, "P6\n%d %d\n255\n", width, height); /* Header size */
+
+  rgbpixels(pixels, (long) width*height, out + n);
+  return n + 3L*width*height;
+}
+
+/* Deflate bit stream (bits are packed from the least significant) */
+struct bitstream {
+  unsigned char * p;   /* Next byte */
+  uint32_t bits;       /* Bits not yet stored */
+  int n;               /* Number of bits not yet stored */
+};
+
+/* Append n bits */
+static __inline__ void putbits(struct bitstream * b, uint32_t value, int n)
+{
+  b->bits |= value << b->n;
+  b->n += n;
+  while(b->n >= 8) {
+    *b->p++ = b->bits;
+    b->bits >>= 8;
+    b->n -= 8;
+  }
+}
+
+/* Append a fixed Huffman code for a literal or length symbol (Huffman codes
+   are stored from the most significant bit) */
+static __inline__ void putsymbol(struct bitstream * b, int symbol)
+{
+  int code, n, r, k; /* Code, length, reversed code, bit */
+
+  if(symbol < 144) {code = 0x30 + symbol; n = 8;}
+  else if(symbol < 256) {code = 0x190 + symbol - 144; n = 9;}
+  else if(symbol < 280) {code = symbol - 256; n = 7;}
+  else {code = 0xC0 + symbol - 280; n = 8;}
+
+  for(r = 0, k = 0; k < n; k++) r |= ((code >> k) & 1) << (n - 1 - k);
+  putbits(b, r, n);
+}
+
+/* Compress data into a zlib stream with a single fixed Huffman block, in
+   which runs of repeated bytes become copies at distance 1 (returns the size
+   of the stream, at most 9/8 of the data plus 16 bytes) */
+long deflaterun(const unsigned char * data, long n, unsigned char * out)
+{
+  static const int base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258}; /* Run lengths */
+  static const int extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0}; /* Extra bits of the lengths */
+  struct bitstream b = {out + 2, 0, 0}; /* Compressed bits */
+  uint32_t s1 = 1, s2 = 0; /* Adler-32 sums */
+  long i, r; /* Position, run length */
+  int l; /* Length symbol */
+
+  out[0] = 0x78; /* Deflate, 32K window */
+  out[1] = 0x01; /* Header check */
+  putbits(&b, 1, 1); /* Last block */
+  putbits(&b, 1, 2); /* Fixed Huffman codes */
+  for(i = 0; i < n; ) {
+    for(r = 0; i > 0 && r < 258 && i + r < n && data[i + r] == data[i - 1]; r++);
+    if(r >= 3) {
+      for(l = 28; base[l] > r; l--);
+      putsymbol(&b, 257 + l);
+      putbits(&b, r - base[l], extra[l]);
+      putbits(&b, 0, 5); /* Distance 1 */
+      i += r;
+    }
+    else putsymbol(&b, data[i++]);
+  }
+  putsymbol(&b, 256); /* End of block */
+  putbits(&b, 0, 7); /* Flush the last byte */
+
+  for(i = 0; i < n; i++) { /* Adler-32 (sums reduced often enough not to overflow) */
+    s1 += data[i];
+    s2 += s1;
+    if((i & 4095) == 4095) {
+      s1 %= 65521;
+      s2 %= 65521;
+    }
+  }
+  b.p = putbig(b.p, (s2 % 65521) << 16 | (s1 % 65521));
+
+  return b.p - out;
+}
+
+/* Encode an image as a png file into a buffer of at least
+   (3*width + 1)*height*9/8 + 128 bytes, using another buffer of
+   (3*width + 1)*height bytes for the filtered rows (returns the size of
+   the file). Rows are stored as differences with the pixel to the left, so
+   that flat areas become runs of zeros. */
+long encodepng(const uint32_t * pixels, int width, int height, unsigned char * out,
+               unsigned char * filtered)
+{
+  static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  unsigned char * p = filtered; /* Filtered data */
+  unsigned char * chunk; /* Beginning of a chunk */
+  uint32_t c, left; /* Pixel, pixel to the left */
+  long size; /* Compressed size */
+  int i, j; /* Pixel coordinates */
+
+  for(j = 0; j < height; j++) {
+    *p++ = 1; /* Sub filter */
+    left = 0;
+    for(i = 0; i < width; i++) {
+      c = pixels[(long) width*j + i];
+      *p++ = (c >> 16) - (left >> 16);
+      *p++ = (c >> 8) - (left >> 8);
+      *p++ = c - left;
+      left = c;
+    }
+  }
+
+  memcpy(out, signature, 8);
+  chunk = out + 8; /* Header: size, 8-bit RGB, no interlacing */
+  memcpy(putbig(chunk, 13), "IHDR", 4);
+  putbig(putbig(chunk + 8, width), height);
+  memcpy(chunk + 16, (unsigned char []) {8, 2, 0, 0, 0}, 5);
+  putbig(chunk + 21, crc32(chunk + 4, 17));
+
+  chunk += 25; /* Compressed image */
+  size = deflaterun(filtered, p - filtered, chunk + 8);
+  memcpy(putbig(chunk, size), "IDAT", 4);
+  putbig(chunk + 8 + size, crc32(chunk + 4, size + 4));
+
+  chunk += size + 12; /* End */
+  memcpy(putbig(chunk, 0), "IEND", 4);
+  putbig(chunk + 8, crc32(chunk + 4, 4));
+
+  return chunk + 12 - out;
+}
+
+/*** Frame output ***/
+
+/* Write a block of data to the output file or pipe. Pipes may receive the
+   pages themselves with vmsplice, falling back to write if the kernel
+   refuses. */
+bool writedata(struct recorder * v, void * data, size_t size, bool splice)
+{
+  struct iovec iov = {data, size}; /* Unwritten data */
+  int fd = fileno(v->file); /* File descriptor */
+  ssize_t n; /* Bytes written */
+
+  while(iov.iov_len > 0) {
+    if(splice && v->splice) {
+      n = vmsplice(fd, &iov, 1, 0);
+      if(n < 0 && errno != EINTR && errno != EAGAIN) {
+        v->splice = false;
+        continue;
+      }
+    }
+    else {
+      n = write(fd, iov.iov_base, iov.iov_len);
+      if(n < 0 && errno != EINTR) return false;
+    }
+    if(n > 0) {
+      iov.iov_base = (char *) iov.iov_base + n;
+      iov.iov_len -= n;
+    }
+  }
+
+  return true;
+}
+
+/* Check that a name pattern has a single integer conversion for the frame
+   number (like %d or %04d) and no other conversion than %%, so that it is
+   safe to use as a format */
+bool framepattern(const char * pattern)
+{
+  const char * p; /* Character */
+  int n = 0; /* Frame number conversions */
+
+  for(p = strchr(pattern, '%'); p != NULL; p = strchr(p, '%')) {
+    p++;
+    if(*p == '%') {
+      p++;
+      continue;
+    }
+    while(isdigit((unsigned char) *p)) p++;
+    if(*p != 'd') return false;
+    n++;
+  }
+
+  return (n == 1);
+}
+
+/* Write frame k, stored in a buffer of packed 32-bit pixels */
+bool writeframe(struct recorder * v, uint32_t * buffer, int k)
+{
+  char filename[1024]; /* Name of the image file */
+  long size; /* Size of the encoded image */
+  FILE * file; /* Image file */
+
+  if(v->format == OUTPUT_RAW)
+    return writedata(v, buffer, v->width*v->height*sizeof(uint32_t), true);
+
+  if(v->format == OUTPUT_PNG)
+    size = encodepng(buffer, v->width, v->height, v->encoded, v->filtered);
+  else
+    size = encodeppm(buffer, v->width, v->height, v->encoded);
+  if(v->file != NULL) return writedata(v, v->encoded, size, false);
+
+  snprintf(filename, sizeof(filename), v->pattern, k);
+  file = fopen(filename, "w");
+  if(file == NULL || fwrite(v->encoded, 1, size, file) != (size_t) size) {
+    fprintf(stderr, "Error: unable to write %s.\n", filename);
+    if(file != NULL) fclose(file);
+    return false;
+  }
+  fclose(file);
+
+  return true;
+}
+
+/* Writer thread: write queued frames in order. Pages spliced into a pipe stay
+   in use until the encoder reads them, so a spliced buffer is kept until the
+   next frame (larger than the pipe) has been spliced after it. */
+void * writer(void * arg)
+{
+  struct recorder * v = arg; /* Frame writer */
+  int b; /* Buffer */
+  bool ok; /* Frame written */
+
+  pthread_mutex_lock(&v->lock);
+  for(;;) {
+    while(v->count == v->kept && !v->quit) pthread_cond_wait(&v->notempty, &v->lock);
+    if(v->count == v->kept) break;
+
+    b = (v->head + v->kept)%v->nbuffers;
+    pthread_mutex_unlock(&v->lock);
+    ok = !v->failed && writeframe(v, v->buffers[b], v->number[b]);
+    pthread_mutex_lock(&v->lock);
+
+    if(!ok && !v->failed) {
+      if(v->file != NULL) fprintf(stderr, "Error: unable to write video frames.\n");
+      v->failed = true;
+    }
+    if(ok) v->written++;
+    else v->dropped++;
+
+    /* Release the previous frame, and this one if it was not spliced */
+    if(v->kept) {
+      v->head = (v->head + 1)%v->nbuffers;
+      v->count--;
+      v->kept = 0;
+    }
+    if(v->format == OUTPUT_RAW && v->splice) v->kept = 1;
+    else {
+      v->head = (v->head + 1)%v->nbuffers;
+      v->count--;
+    }
+    pthread_cond_signal(&v->notfull);
+  }
+  pthread_mutex_unlock(&v->lock);
+
+  return NULL;
+}
+
+/* Start writing frames in a format (OUTPUT_RAW, OUTPUT_PPM or OUTPUT_PNG),
+   either into a file or pipe, or, if the file is NULL, into one file per
+   frame named by a pattern with the frame number (as in "frame%04d.png").
+   Unless lossless is set, frames are dropped when every buffer is in use. */
+void startrecorder(struct recorder * v, int format, FILE * file, bool pipe, char * pattern,
+                   int width, int height, bool lossless)
+{
+  struct stat st; /* Output file status */
+  int i; /* Buffer index */
+
+  v->format = format;
+  v->file = file;
+  v->pipe = pipe;
+  v->pattern = pattern;
+  v->splice = (file != NULL && fstat(fileno(file), &st) == 0 && S_ISFIFO(st.st_mode)
+               && fcntl(fileno(file), F_GETPIPE_SZ) < width*height*(int) sizeof(uint32_t));
+  v->lossless = lossless;
+  v->width = width;
+  v->height = height;
+
+  v->nbuffers = VIDEO_BUFFERS;
+  v->buffers = malloc(v->nbuffers*sizeof(uint32_t *));
+  v->number = malloc(v->nbuffers*sizeof(int));
+  for(i = 0; v->buffers != NULL && i < v->nbuffers; i++)
+    if((v->buffers[i] = alignedalloc(width*height*sizeof(uint32_t))) == NULL) break;
+  v->encoded = v->filtered = NULL;
+  if(format == OUTPUT_PPM) v->encoded = malloc(3L*width*height + 32);
+  if(format == OUTPUT_PNG) {
+    makecrctable();
+    v->encoded = malloc((3L*width + 1)*height*9/8 + 128);
+    v->filtered = malloc((3L*width + 1)*height);
+  }
+  if(v->buffers == NULL || i < v->nbuffers || v->number == NULL
+     || (format != OUTPUT_RAW && v->encoded == NULL)
+     || (format == OUTPUT_PNG && v->filtered == NULL)) {
+    fprintf(stderr, "Error: unable to allocate memory for video frames.\n");
+    exit(-1);
+  }
+
+  v->head = v->count = v->kept = 0;
+  v->written = v->dropped = v->peak = 0;
+  v->failed = v->quit = false;
+  pthread_mutex_init(&v->lock, NULL);
+  pthread_cond_init(&v->notempty, NULL);
+  pthread_cond_init(&v->notfull, NULL);
+  if(pthread_create(&v->thread, NULL, writer, v)) {
+    fprintf(stderr, "Error: unable to start the frame writer thread.\n");
+    exit(-1);
+  }
+}
+
+/* Queue the image as frame k (dropping it if every buffer is in use, or
+   waiting for a buffer in lossless mode) */
+void recordframe(struct recorder * v, struct raster * r, int k)
+{
+  int b; /* Free buffer */
+
+  pthread_mutex_lock(&v->lock);
+  while(v->lossless && v->count == v->nbuffers && !v->failed)
+    pthread_cond_wait(&v->notfull, &v->lock);
+  if(v->count == v->nbuffers || v->failed) {
+    v->dropped++;
+    pthread_mutex_unlock(&v->lock);
+    return;
+  }
+  b = (v->head + v->count)%v->nbuffers;
+  pthread_mutex_unlock(&v->lock);
+
+  copypixels(r, v->buffers[b]); /* The writer does not touch free buffers */
+  v->number[b] = k;
+
+  pthread_mutex_lock(&v->lock);
+  v->count++;
+  if(v->count - v->kept > v->peak) v->peak = v->count - v->kept;
+  pthread_cond_signal(&v->notempty);
+  pthread_mutex_unlock(&v->lock);
+}
+
+/* Write the queued frames and free the buffers (the file is not closed) */
+void stoprecorder(struct recorder * v)
+{
+  int i; /* Buffer index */
+
+  pthread_mutex_lock(&v->lock);
+  v->quit = true;
+  pthread_cond_signal(&v->notempty);
+  pthread_mutex_unlock(&v->lock);
+  pthread_join(v->thread, NULL);
+
+  for(i = 0; i < v->nbuffers; i++) free(v->buffers[i]);
+  free(v->buffers);
+  free(v->number);
+  free(v->encoded);
+  free(v->filtered);
+  pthread_mutex_destroy(&v->lock);
+  pthread_cond_destroy(&v->notempty);
+  pthread_cond_destroy(&v->notfull);
+}
+
+/* Start recording video, into video.raw or through an encoder program
+   (ffmpeg or avconv) producing video.mp4 */
+void startvideo(struct recorder * v, char * encoder, int width, int height)
+{
+  char command[250]; /* Encoder command */
+  bool pipe = strcmp(encoder, "raw"); /* Encoder pipe */
+  FILE * file; /* Video file or pipe */
+
+  if(pipe) {
+    snprintf(command, sizeof(command),
+             "%s -loglevel panic -y -f rawvideo -s %dx%d -pix_fmt rgb32"
+             " -r 30 -i - -an -b:v 24000k video.mp4", encoder, width, height);
+    signal(SIGPIPE, SIG_IGN); /* Report a failed encoder instead of quitting */
+    file = popen(command, "w");
+  }
+  else file = fopen("video.raw", "w");
+  if(file == NULL) {
+    fprintf(stderr, "Error: unable to open video pipe.\n");
+    exit(-1);
+  }
+
+  startrecorder(v, OUTPUT_RAW, file, pipe, NULL, width, height, false);
+  fprintf(stderr, "Recording video...\n");
+}
+
+/* Finish the video and report */
+void stopvideo(struct recorder * v)
+{
+  stoprecorder(v);
+  if(v->pipe) pclose(v->file);
+  else fclose(v->file);
+
+  fprintf(stderr, "Recording stopped: %d frames written, %d dropped"
+                  " (at most %d queued).\n", v->written, v->dropped, v->peak);
+}
+
+/*** Binary trajectory conversion ***/
+
+/* Convert an ASCII data file into a binary trajectory */
+int convert(FILE * mddata, char * filename, bool int16, bool delta)
+{
+  struct trajectory t = {{0}}; /* Data file and frame index */
+  struct frame f = {0}, first = {0}; /* Particle data, first frame */
+  struct binheader h = {"MPB1"}; /* Binary trajectory header */
+  float lo[3] = {0}, hi[3] = {0}; /* Bounding box */
+  long long * offsets; /* Positions of frames */
+  long nparticles = 0; /* Total number of particles */
+  FILE * out; /* Binary trajectory file */
+  struct keyframe key = {0}; /* Keyframe written last (delta encoding) */
+  int i, k; /* Indices */
+
+  opentext(&t.text, mddata, false);
+  t.textend = telltext(&t.text);
+  if(ftell(mddata) < 0) t.cache = tmpfile(); /* Pipes cannot be read twice */
+
+  /* First pass: bounding box and constant radii and colours */
+  h.flags = BIN_RADII | BIN_COLOURS;
+  for(k = 0; getframe(&t, k, &f); k++) {
+    if(k == 0) {
+      growframe(&first, f.n);
+      first.n = h.n = f.n;
+      memcpy(first.R, f.R, f.n*sizeof(float));
+      memcpy(first.c, f.c, f.n*sizeof(int));
+    }
+    else if(f.n != first.n) h.flags &= ~(BIN_RADII | BIN_COLOURS);
+    else {
+      if(memcmp(f.R, first.R, f.n*sizeof(float))) h.flags &= ~BIN_RADII;
+      if(memcmp(f.c, first.c, f.n*sizeof(int))) h.flags &= ~BIN_COLOURS;
+    }
+
+    for(i = 0; i < f.n; i++) {
+      if(nparticles + i == 0) {
+        lo[0] = hi[0] = f.x[i]; lo[1] = hi[1] = f.y[i]; lo[2] = hi[2] = f.z[i];
+      }
+      lo[0] = fminf(lo[0], f.x[i]); hi[0] = fmaxf(hi[0], f.x[i]);
+      lo[1] = fminf(lo[1], f.y[i]); hi[1] = fmaxf(hi[1], f.y[i]);
+      lo[2] = fminf(lo[2], f.z[i]); hi[2] = fmaxf(hi[2], f.z[i]);
+    }
+    nparticles += f.n;
+  }
+  h.nframes = t.nframes;
+  if(h.nframes == 0) {
+    fprintf(stderr, "Error: no frames in the data file.\n");
+    return -1;
+  }
+
+  /* Quantization */
+  if(int16) {
+    h.flags |= BIN_INT16;
+    for(k = 0; k < 3; k++) {
+      h.offset[k] = lo[k];
+      h.scale[k] = (hi[k] > lo[k])?(hi[k] - lo[k])/65535:1;
+    }
+  }
+
+  out = fopen(filename, "w");
+  if(out == NULL) {
+    fprintf(stderr, "Error: unable to open %s.\n", filename);
+    return -1;
+  }
+
+  /* Header, constant radii and colours */
+  fwrite(&h, sizeof(struct binheader), 1, out);
+  if(h.flags & BIN_RADII) fwrite(first.R, sizeof(float), first.n, out);
+  if(h.flags & BIN_COLOURS) fwrite(first.c, sizeof(int), first.n, out);
+
+  /* Second pass: frames */
+  offsets = malloc(h.nframes*sizeof(long long));
+  if(offsets == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the frame index.\n");
+    return -1;
+  }
+  for(k = 0; k < h.nframes; k++) {
+    if(!getframe(&t, k, &f)) {
+      fprintf(stderr, "Error: unable to read frame %d.\n", k);
+      return -1;
+    }
+    offsets[k] = ftell(out);
+    writebinary(out, &f, &h, delta?&key:NULL);
+  }
+
+  /* Frame index */
+  h.index = ftell(out);
+  fwrite(offsets, sizeof(long long), h.nframes, out);
+  fwrite(t.nparticles, sizeof(int), h.nframes, out);
+  fprintf(stderr, "Converted %d frames (%ld particles) into %ld bytes.\n",
+          h.nframes, nparticles, ftell(out));
+  fseek(out, 0, SEEK_SET);
+  fwrite(&h, sizeof(struct binheader), 1, out);
+
+  fclose(out);
+  free(offsets);
+  if(t.cache != NULL) fclose(t.cache);
+  return 0;
+}
+
+/*** Profiling ***/
+
+/* Open a CSV file for the profile of every frame */
+FILE * openstats(char * filename)
+{
+  FILE * file = fopen(filename, "w"); /* Statistics file */
+
+  if(file == NULL) {
+    fprintf(stderr, "Error: unable to open %s.\n", filename);
+    exit(-1);
+  }
+  fprintf(file, "frame,skipped,particles,drawn,tested,visible,occluded,read_ms,wait_ms,"
+                "project_ms,draw_ms,present_ms,capture_ms,clear_ms,total_ms\n");
+
+  return file;
+}
+
+/* Add the profile of a frame to the CSV file */
+void writestats(FILE * file, struct stats * st)
+{
+  fprintf(file, "%d,%d,%d,%d,%ld,%ld,%.4f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+          st->frame, st->skipped, st->particles, st->drawn, st->tested, st->visible,
+          st->discs?(double) st->occluded/st->discs:0,
+          1e3*st->read, 1e3*st->wait, 1e3*st->project, 1e3*st->draw,
+          1e3*st->present, 1e3*st->capture, 1e3*st->clear, 1e3*st->total);
+}
+
+/* Show the profile of a frame in the window, below the message line */
+void drawstats(struct screen * s, struct stats * st, float fps)
+{
+  char line[7][120]; /* Lines of text */
+  int n = 5; /* Number of lines */
+  int i; /* Line */
+
+  sprintf(line[0], "Frame %d: %d particles, %d in view", st->frame, st->particles, st->drawn);
+  sprintf(line[1], "Depth tests %ld, passed %ld (%.0f%%)", st->tested, st->visible,
+          st->tested?100.0*st->visible/st->tested:0);
+  sprintf(line[2], "Read %.2f ms (reader thread), wait %.2f ms",
+          1e3*st->read, 1e3*st->wait);
+  sprintf(line[3], "Project %.2f, draw %.2f, present %.2f ms",
+          1e3*st->project, 1e3*st->draw, 1e3*st->present);
+  sprintf(line[4], "Capture %.2f, clear %.2f, total %.2f ms (%.0f frames/s)",
+          1e3*st->capture, 1e3*st->clear, 1e3*st->total, (st->total > 0)?1/st->total:0);
+  if(st->discs) /* Occlusion culling */
+    sprintf(line[n++], "Hidden discs skipped %ld of %ld (%.0f%%)", st->occluded, st->discs,
+            100.0*st->occluded/st->discs);
+  if(fps > 0) /* Frame pacing */
+    sprintf(line[n++], "Playback %.1f of %g frames/s, %d frames skipped", st->playback, fps,
+            st->skipped);
+  for(i = 0; i < n; i++) XDrawString(s->d, s->w, s->g, 2, 27 + 15*i, line[i], strlen(line[i]));
+}
+
+/*** Benchmarks ***/
+
+/* Measure the parsing throughput on a data file repeated up to a given size */
+int benchparse(FILE * mddata, double megabytes)
+{
+  char * data = NULL, * text; /* Contents of the file, repeated text */
+  size_t n = 0, size = 0, length; /* Bytes read, allocated, length of text */
+  long copies, i; /* Number of copies of the file */
+  struct textreader t = {0}; /* Reader for the text in memory */
+  struct frame f = {0}; /* Particle data */
+  long nframes = 0, nparticles = 0; /* Frames and particles read */
+  char * line, * eol; /* Line in the text */
+  float dat[5]; /* Values in a line */
+  double t0, t1; /* Times */
+
+  /* Read the whole file */
+  do {
+    if(n == size) {
+      size = size?2*size:TEXT_BLOCK;
+      data = realloc(data, size + 1);
+      if(data == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for the benchmark.\n");
+        return -1;
+      }
+    }
+    n += fread(data + n, 1, size - n, mddata);
+  } while(n == size);
+  if(n == 0) {
+    fprintf(stderr, "Error: empty data file.\n");
+    return -1;
+  }
+  if(data[n - 1] != '\n') data[n++] = '\n';
+
+  /* Repeat it up to the requested size */
+  copies = (long) ceil(1e6*megabytes/n);
+  length = copies*n;
+  text = malloc(length + 1);
+  if(text == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the benchmark.\n");
+    return -1;
+  }
+  for(i = 0; i < copies; i++) memcpy(text + i*n, data, n);
+  text[length] = '\0';
+  free(data);
+
+  printf("Parsing %.1f MB (%ld copies of the data file).\n", 1e-6*length, copies);
+
+  /* Block parser */
+  t.buf = text; t.size = t.end = length; t.eof = true;
+  t0 = seconds();
+  while(readtext(&t, &f)) {
+    nframes++;
+    nparticles += f.n;
+  }
+  t1 = seconds();
+  printf("  block parser:  %ld frames, %ld particles, %8.1f MB/s, %8.3g particles/s\n",
+         nframes, nparticles, 1e-6*length/(t1 - t0), nparticles/(t1 - t0));
+
+  /* Line by line sscanf, for reference */
+  nparticles = 0;
+  t0 = seconds();
+  for(line = text; (eol = strchr(line, '\n')); line = eol + 1) {
+    *eol = '\0';
+    if(sscanf(line, "%f %f %f %f %f", &dat[0], &dat[1], &dat[2], &dat[3], &dat[4]) > 2)
+      nparticles++;
+  }
+  t1 = seconds();
+  printf("  sscanf:        %ld frames, %ld particles, %8.1f MB/s, %8.3g particles/s\n",
+         nframes, nparticles, 1e-6*length/(t1 - t0), nparticles/(t1 - t0));
+
+  free(text);
+  return 0;
+}
+
+/* Measure clearing and drawing times per pixel on the first frame of a data
+   file, against the previous per-pixel loops with a column-major z-buffer */
+int benchraster(FILE * mddata, struct camera * cam, int width, int height, int repeats)
+{
+  struct trajectory t = {{0}}; /* Data file */
+  struct frame f = {0}; /* Particle data */
+  struct projection p = {0}; /* Projected particles */
+  struct raster r; /* Rasteriser */
+  uint32_t * pixels = alignedalloc(width*height*sizeof(uint32_t)); /* Image */
+  float * zbuffer = alignedalloc(width*height*sizeof(float)); /* Z-buffer */
+  float backdrop; /* Maximum allowed depth */
+  long npixels = 0; /* Pixels covered by particles */
+  double tclear[2] = {0}, tdraw[2] = {0}, t0; /* Times (before, after) */
+  int n, i, j, k, m, xs, ys, s; /* Indices and screen coordinates */
+
+  opentext(&t.text, mddata, false);
+  t.textend = telltext(&t.text);
+  if(!pixels || !zbuffer || !getframe(&t, 0, &f)) {
+    fprintf(stderr, "Error: unable to read the first frame.\n");
+    return -1;
+  }
+  project(&f, cam, width, height, &p);
+  startraster(&r, NULL, pixels, zbuffer, width, height, 1);
+  r.fade = 1;
+  r.backdrop = cam->distance;
+
+  for(n = 0; n < repeats; n++) {
+    /* Previous clear loop (column-major, depth recomputed for every pixel) */
+    t0 = seconds();
+    for(i = 0; i < width; i++) {
+      for(j = 0; j < height; j++) {
+        pixels[width*j + i] = 0;
+        backdrop = 0;
+        for(k = 0; k < 3; k++)
+          backdrop += (cam->aim[k] - cam->location[k])*(cam->aim[k] - cam->location[k]);
+        backdrop = sqrtf(backdrop);
+        zbuffer[height*i + j] = 2.5f*backdrop;
+      }
+    }
+    tclear[0] += seconds() - t0;
+
+    /* Previous disc loop (column-major z-buffer, every pixel tested) */
+    t0 = seconds();
+    for(m = 0; m < p.n; m++) {
+      xs = p.xs[m]; ys = p.ys[m]; s = p.s[m];
+      for(i = -s; i <= s; i++) {
+        for(j = -s; j <= s; j++) {
+          if(i*i + j*j > s*s) continue;
+          float lighting = s?sqrtf(1.0f - (float) (i*i + j*j)/(s*s)):1.0f;
+          if(lighting > 1) lighting = 1.0f;
+          if(abs(xs + i - width/2) < width/2 && abs(ys + j - height/2) < height/2) {
+            if(n == 0) npixels++;
+            if(zbuffer[height*(xs + i)+(ys + j)] > p.depth[m] - lighting) {
+              zbuffer[height*(xs + i)+(ys + j)] = p.depth[m] - lighting;
+              lighting *= (1.0f - (p.depth[m] - 1.0f)/(0.5f*r.backdrop - 1.0f));
+              if(lighting < 0.0f) lighting = 0.0f;
+              pixels[width*(ys + j) + xs + i] = (int) (p.c[m]/65536*lighting)*65536
+                + (int) ((p.c[m]/256)%256*lighting)*256 + (int) (p.c[m]%256*lighting);
+            }
+          }
+        }
+      }
+    }
+    tdraw[0] += seconds() - t0;
+
+    /* Current row-major clear and span loops */
+    t0 = seconds();
+    clearraster(&r, 0, FAR_PLANE*cam->distance);
+    tclear[1] += seconds() - t0;
+    t0 = seconds();
+    render(&r, &p);
+    tdraw[1] += seconds() - t0;
+  }
+
+  printf("%d particles, %ld pixels covered, %d repeats, %s span kernel.\n",
+         p.n, npixels, repeats, r.kernel);
+  printf("  clear: %8.3f ns/pixel before, %8.3f ns/pixel after\n",
+         1e9*tclear[0]/(repeats*width*height), 1e9*tclear[1]/(repeats*width*height));
+  if(npixels > 0)
+    printf("  draw:  %8.3f ns/pixel before, %8.3f ns/pixel after\n",
+           1e9*tdraw[0]/(repeats*npixels), 1e9*tdraw[1]/(repeats*npixels));
+
+  free(pixels);
+  free(zbuffer);
+  return 0;
+}
+
+/* Pseudo-random number in [0, 1) (xorshift64*, the same sequence on every run) */
+double uniform(uint64_t * seed)
+{
+  *seed ^= *seed >> 12;
+  *seed ^= *seed << 25;
+  *seed ^= *seed >> 27;
+  return (*seed*0x2545F4914F6CDD1DULL >> 11)*0x1.0p-53;
+}
+
+/* Set up a synthetic system of n particles ("lattice", "gas" or "droplet"),
+   with radii uniformly distributed between rmin and rmax (if rmax > 0) */
+bool makesystem(struct synthetic * y, char * name, long n, float rmin, float rmax)
+{
+  float r = (rmax > 0)?0.5f*(rmin + rmax):1.0f; /* Mean radius */
+
+  y->n = n;
+  y->rmin = rmin;
+  y->rmax = rmax;
+  y->seed = 0x9E3779B97F4A7C15ULL;
+  if(!strcmp(name, "lattice")) { /* Same spacing and radii as examples/NaCl.dat */
+    y->kind = SYSTEM_LATTICE;
+    for(y->side = 1; (long) y->side*y->side*y->side < n; y->side++);
+    y->spacing = (rmax > 0)?2.7f*r/1.415f:2.7f;
+    y->size = 0.5f*(y->side - 1)*y->spacing + ((rmax > 0)?rmax:1.67f);
+  }
+  else if(!strcmp(name, "gas")) {
+    y->kind = SYSTEM_GAS;
+    y->size = 0.5f*cbrtf(n*4.18879f*r*r*r/0.05f);
+  }
+  else if(!strcmp(name, "droplet")) {
+    y->kind = SYSTEM_DROPLET;
+    y->size = cbrtf(n*r*r*r/0.5f);
+  }
+  else return false;
+  return true;
+}
+
+/* Place the particles of a synthetic system in the first frame (t = 0), or
+   move them by a small random step: vibration around the lattice sites and
+   diffusion in the gas (in a periodic box) and in the droplet */
+void movesystem(struct synthetic * y, struct frame * f, int t)
+{
+  static const int palette[4] = {0xFF4020, 0x20A0FF, 0xFFD040, 0x40FF80}; /* Colours */
+  float * x[3]; /* Positions */
+  float L = y->size; /* Half size of the box, or droplet radius */
+  float a = y->spacing; /* Lattice spacing */
+  float site[3]; /* Lattice site */
+  long k, l; /* Particle and site indices */
+  int i, species; /* Coordinate, lattice species */
+
+  if(t == 0) growframe(f, y->n);
+  f->n = y->n;
+  x[0] = f->x; x[1] = f->y; x[2] = f->z;
+  f->newmsg = f->newcamera = false;
 
-/*** Key codes ***/
-/* Check key codes with xmodmap -pk */
-# define KEY_PLUS  XK_plus
-# define KEY_MINUS XK_minus
-# define KEY_LEFT  XK_Left
-# define KEY_RIGHT XK_Right
-# define KEY_UP    XK_Up
-# define KEY_DOWN  XK_Down
-# define KEY_Q     XK_Q
-# define KEY_q     XK_q
-# define KEY_ESC   XK_Escape
-# define KEY_W     XK_W
-# define KEY_w     XK_w
-# define KEY_A     XK_A
-# define KEY_a     XK_a
-# define KEY_B     XK_B
-# define KEY_b     XK_b
-# define KEY_S     XK_S
-# define KEY_s     XK_s
-# define KEY_D     XK_D
-# define KEY_d     XK_d
-# define KEY_Z     XK_Z
-# define KEY_z     XK_z
-# define KEY_X     XK_X
-# define KEY_x     XK_x
-# define KEY_R     XK_R
-# define KEY_r     XK_r
-# define KEY_F     XK_F
-# define KEY_f     XK_f
-# define KEY_1     XK_1
-# define KEY_2     XK_2
-# define KEY_3     XK_3
-# define KEY_4     XK_4
-# define KEY_P     XK_P
-# define KEY_p     XK_p
-# define KEY_SPC   XK_space
-# define KEY_C     XK_C
-# define KEY_c     XK_c
-# define KEY_O     XK_O
-# define KEY_o     XK_o
-# define KEY_0     XK_0
+  for(k = 0; k < y->n; k++) {
+    if(y->kind == SYSTEM_LATTICE) { /* Rock salt structure */
+      l = k;
+      species = 0;
+      for(i = 0; i < 3; i++) {
+        site[i] = (l%y->side - 0.5f*(y->side - 1))*a;
+        species += l%y->side;
+        l /= y->side;
+      }
+      for(i = 0; i < 3; i++)
+        x[i][k] = site[i] + ((t > 0)?0.06f*a*(uniform(&y->seed) - 0.5f):0);
+      if(t == 0) {
+        f->R[k] = (species%2)?1.67f:1.16f;
+        f->c[k] = (species%2)?65208:255;
+      }
+    }
+    else if(t == 0) { /* Uniformly in the box, or in the droplet */
+      do {
+        for(i = 0; i < 3; i++) x[i][k] = L*(2*uniform(&y->seed) - 1);
+      } while(y->kind == SYSTEM_DROPLET
+              && x[0][k]*x[0][k] + x[1][k]*x[1][k] + x[2][k]*x[2][k] > L*L);
+      f->R[k] = 1;
+      f->c[k] = palette[(int) (4*uniform(&y->seed))];
+    }
+    else if(y->kind == SYSTEM_GAS) { /* Free flight in a periodic box */
+      for(i = 0; i < 3; i++) {
+        x[i][k] += uniform(&y->seed) - 0.5f;
+        if(x[i][k] > L) x[i][k] -= 2*L;
+        if(x[i][k] < -L) x[i][k] += 2*L;
+      }
+    }
+    else /* Slow diffusion in the droplet */
+      for(i = 0; i < 3; i++) x[i][k] += 0.1f*(uniform(&y->seed) - 0.5f);
 
-/*** Mathematical vector functions ***/
-/* Dot product */
-__inline__ float dot(float u[3], float v[3]) {
-  int i; /* Index */
-  float prod = 0; /* Scalar product */
+    if(t == 0 && y->rmax > 0) /* Radius distribution */
+      f->R[k] = y->rmin + (y->rmax - y->rmin)*uniform(&y->seed);
+  }
+}
 
-  for(i = 0; i < 3; i++)
-    prod += u[i]*v[i];
+/* Write a frame as ASCII data */
+void writetext(FILE * file, struct frame * f)
+{
+  int k; /* Particle index */
 
-  return prod;
+  for(k = 0; k < f->n; k++)
+    fprintf(file, "%.3f %.3f %.3f %.3f %d\n", f->x[k], f->y[k], f->z[k], f->R[k], f->c[k]);
+  fprintf(file, "\n");
 }
 
-/* Cross product */
-__inline__ void cross(float u[3], float v[3], float uxv[3]) {
-  float x, y, z;
+/* Write an ASCII trajectory of a synthetic system (- for stdout) */
+int generate(char * name, long n, int nframes, float rmin, float rmax, char * filename)
+{
+  struct synthetic y; /* Synthetic system */
+  struct frame f = {0}; /* Particle data */
+  FILE * file; /* Output file */
+  int t; /* Frame number */
 
-  x = u[1]*v[2] - u[2]*v[1];
-  y = u[2]*v[0] - u[0]*v[2];
-  z = u[0]*v[1] - u[1]*v[0];
+  if(n < 1 || n > INT_MAX || !makesystem(&y, name, n, rmin, rmax)) {
+    fprintf(stderr, "Error: unknown system %s or invalid number of particles.\n", name);
+    return -1;
+  }
+  file = strcmp(filename, "-")?fopen(filename, "w"):stdout;
+  if(file == NULL) {
+    fprintf(stderr, "Error: unable to open %s.\n", filename);
+    return -1;
+  }
 
-  uxv[0] = x;
-  uxv[1] = y;
-  uxv[2] = z;
+  for(t = 0; t < nframes; t++) {
+    movesystem(&y, &f, t);
+    writetext(file, &f);
+  }
 
-  return;
+  if(file != stdout) fclose(file);
+  else fflush(stdout);
+  return 0;
 }
 
-/* Modulus of a vector */
-__inline__ float modulus(float v[3]) {
-  return sqrt(dot(v, v));
+/* Comparison function for qsort */
+int comparetimes(const void * a, const void * b)
+{
+  double x = *(const double *) a, y = *(const double *) b; /* Times */
+
+  return (x > y) - (x < y);
 }
 
-/* Rotate a vector by a given angle around an axis */
-__inline__ void rotate(float v[3], float axis[3], float angle) {
+/* Print the median and 99th percentile of a set of frame times, and the
+   frame and particle throughput */
+void printtimes(const char * phase, double * t, int n, long particles)
+{
+  double total = 0; /* Total time */
   int i; /* Index */
-  float rot[3]; /* Rotation */
-  float length1, length2; /* Length of a vector */
 
-  length1 = angle/modulus(axis);
-  for(i = 0; i < 3; i++) rot[i] = length1*axis[i];
-  length1 = modulus(v);
-  cross(v, rot, rot);
-  for(i = 0; i < 3; i++) v[i] += rot[i];
-  length2 = modulus(v);
-  for(i = 0; i < 3; i++) v[i] *= length1/length2;
+  for(i = 0; i < n; i++) total += t[i];
+  qsort(t, n, sizeof(double), comparetimes);
+  printf("  %-8s median %8.3f ms, p99 %8.3f ms, %8.1f frames/s, %9.3g particles/s\n",
+         phase, 1e3*t[n/2], 1e3*t[(99*n + 99)/100 - 1], n/total, n*particles/total);
 }
 
-/*** Data types ***/
+/* Benchmark the stages of a frame on the first frame of a synthetic system:
+   parsing its ASCII data, drawing it from a fixed path of camera positions
+   around it, and presenting the images (encoding them as ppm images, or
+   sending them to X in a window with x set, so that results only depend on
+   the environment when asked to) */
+int benchmark(char * name, long n, float rmin, float rmax, int width, int height,
+              int nthreads, bool occlusion, float aggregate, bool shm, bool x)
+{
+  struct synthetic y; /* Synthetic system */
+  struct frame f = {0}, g = {0}; /* Particle data: generated, parsed */
+  struct textreader t; /* Reader for the text in memory */
+  struct camera cam; /* Camera */
+  struct projection p = {0}; /* Projected particles */
+  struct raster r; /* Rasteriser */
+  struct screen s; /* Window images (with a display) */
+  Display * d; /* X display */
+  Window w = 0; /* Window */
+  XWindowAttributes wa; /* Window attributes */
+  char * text = NULL; /* ASCII data */
+  size_t length = 0; /* Length of the ASCII data */
+  FILE * file; /* Stream into the ASCII data */
+  uint32_t * pixels = alignedalloc(width*height*sizeof(uint32_t)); /* Image */
+  float * zbuffer = alignedalloc(width*height*sizeof(float)); /* Z-buffer */
+  unsigned char * encoded = malloc(3*width*height + 32); /* Ppm image */
+  double tparse[BENCH_FRAMES], traster[BENCH_FRAMES], tpresent[BENCH_FRAMES]; /* Times */
+  double tframe[BENCH_FRAMES]; /* Raster and present times */
+  double t0; /* Time */
+  float loc[3], aim[3] = {0, 0, 0}, zen[3] = {0, 0, 1}; /* Camera */
+  float angle, distance; /* Camera position on the path */
+  int nparse, k; /* Parsing repetitions, index */
+  long discs = 0, occluded = 0; /* Discs drawn and skipped as hidden */
 
-/* Boolean type */
-typedef enum {false = 0, true} bool;
+  if(n < 1 || n > INT_MAX || !makesystem(&y, name, n, rmin, rmax)) {
+    fprintf(stderr, "Error: unknown system %s or invalid number of particles.\n", name);
+    return -1;
+  }
+  if(!pixels || !zbuffer || !encoded) {
+    fprintf(stderr, "Error: unable to allocate memory for the image.\n");
+    return -1;
+  }
 
-/* Camera data type */
-struct camera {
-  float location[3];  /* Location */
-  float aim[3];       /* Point to look at */
-  float distance;     /* Distance from aim */
-  float direction[3]; /* Direction unit vector */
-  float screenx[3], screeny[3]; /* Direction of the screen x and y axes */
-};
+  /* Generate the first frame and its ASCII data */
+  t0 = seconds();
+  movesystem(&y, &f, 0);
+  file = open_memstream(&text, &length);
+  if(file == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the benchmark.\n");
+    return -1;
+  }
+  writetext(file, &f);
+  fclose(file);
+  printf("%s: %ld particles, %.1f MB of ASCII data (generated in %.2f s), %dx%d pixels.\n",
+         name, n, 1e-6*length, seconds() - t0, width, height);
 
-/* RGB colour */
-struct colour {
-  int r;
-  int g;
-  int b;
-};
+  /* Parse phase: up to BENCH_FRAMES times, and for about 10 million particles */
+  nparse = 1e7/n;
+  if(nparse < 3) nparse = 3;
+  if(nparse > BENCH_FRAMES) nparse = BENCH_FRAMES;
+  for(k = 0; k < nparse; k++) {
+    memset(&t, 0, sizeof(t));
+    t.buf = text; t.size = t.end = length; t.eof = true;
+    t0 = seconds();
+    readtext(&t, &g);
+    tparse[k] = seconds() - t0;
+  }
+  free(text);
+  if(g.n != f.n) {
+    fprintf(stderr, "Error: %d particles parsed instead of %d.\n", g.n, f.n);
+    return -1;
+  }
 
-/*** Auxiliary functions ***/
+  /* Open a window if asked to */
+  d = x?XOpenDisplay((char *) 0):NULL;
+  if(x && d == NULL) {
+    fprintf(stderr, "Error: unable to open the X display.\n");
+    return -1;
+  }
+  if(d) {
+    w = XCreateSimpleWindow(d, DefaultRootWindow(d), 0, 0, width, height, 5, 0, 0);
+    XStoreName(d, w, "minipunto (benchmark)");
+    XGetWindowAttributes(d, w, &wa);
+    openscreen(&s, d, w, DefaultGC(d, 0), wa.depth, width, height, shm);
+    XMapRaised(d, w);
+    XSync(d, False);
+  }
+  startraster(&r, NULL, pixels, zbuffer, width, height, nthreads);
+  r.fade = 1;
+  r.occlusion = occlusion;
+  p.aggregate = aggregate;
+  buildgrid(&p.grid, &g); /* As for a frame on screen while the camera moves */
 
-/* Set up camera position and orientation */
-void setcamera(struct camera * cam, float location[3], float aim[3], float zenith[3])
+  /* Raster and present phases, on a circle around the system */
+  distance = 1.2f*3.732f*y.size;
+  for(k = 0; k < BENCH_FRAMES; k++) {
+    angle = 2*M_PI*k/BENCH_FRAMES;
+    loc[0] = distance*cosf(angle);
+    loc[1] = distance*sinf(angle);
+    loc[2] = 0.3f*distance;
+    setcamera(&cam, loc, aim, zen);
+
+    t0 = seconds();
+    if(d) setimage(&r, nextimage(&s));
+    clearraster(&r, 0, FAR_PLANE*cam.distance);
+    project(&g, &cam, width, height, &p);
+    r.backdrop = cam.distance;
+    render(&r, &p);
+    traster[k] = seconds() - t0;
+    discs += r.discs;
+    occluded += r.occluded;
+
+    t0 = seconds();
+    if(d) {
+      updateimage(&r);
+      showimage(&s);
+      XSync(d, False);
+    }
+    else encodeppm(pixels, width, height, encoded);
+    tpresent[k] = seconds() - t0;
+    tframe[k] = traster[k] + tpresent[k];
+  }
+
+  printf("Images presented %s.\n", d?(s.shm?"to X (shared memory)":"to X (XPutImage)")
+                                    :"as ppm images (without X)");
+  printtimes("parse", tparse, nparse, n);
+  printtimes("raster", traster, BENCH_FRAMES, n);
+  printtimes(d?(s.shm?"present":"put"):"ppm", tpresent, BENCH_FRAMES, n);
+  printtimes("frame", tframe, BENCH_FRAMES, n);
+  if(occlusion)
+    printf("  %.1f%% of the discs skipped as hidden\n", discs?100.0*occluded/discs:0);
+
+  if(d) {
+    closescreen(&s);
+    XCloseDisplay(d);
+  }
+  free(pixels);
+  free(zbuffer);
+  free(encoded);
+  return 0;
+}
+
+/*** Headless rendering ***/
+
+/* Draw every step-th frame of a data file without X, as fast as possible,
+   into binary ppm or png images. The output is either a file name pattern
+   with the frame number (as in "frame%04d.ppm" or "frame%04d.png"), or a
+   single file (- for stdout) receiving a stream of images (png if its name
+   ends in .png). Images are
+   encoded and written by a separate thread. Camera commands are followed;
+   messages are not drawn. */
+int headless(FILE * mddata, char * output, int step, float loc[3], float aim[3],
+             float zen[3], int background, int fade, int width, int height,
+             int nthreads, bool occlusion, float aggregate, float cutoff, int samples,
+             bool tent, int queuedepth, int nframe, FILE * statsfile)
 {
-  int i; /* Coordinate index */
-  float r; /* Vector modulus */
+  struct trajectory traj = {{mddata}}; /* Data file and frame index */
+  struct pipeline queue; /* Frames read ahead by the reader thread */
+  struct frame frm = {0}; /* Particle data in current frame */
+  struct camera cam; /* Camera */
+  struct projection proj = {0}; /* Particles projected on the screen */
+  struct raster rast; /* Rasteriser */
+  struct supersampler ss; /* Supersampler (drawing into the image of rast) */
+  struct recorder images; /* Image writer */
+  uint32_t * pixels = alignedalloc(width*height*sizeof(uint32_t)); /* Image */
+  float * zbuffer = alignedalloc(width*height*sizeof(float)); /* Z-buffer */
+  int length = strlen(output); /* Length of the output name */
+  int format = (length > 4 && !strcmp(output + length - 4, ".png"))?
+               OUTPUT_PNG:OUTPUT_PPM; /* Image format, from the name */
+  FILE * file = NULL; /* Output file */
+  int k, nframes = 0; /* Frame numbers, number of frames drawn */
+  struct stats st = {0}; /* Frame profile */
+  double t0, t, tframe, tstage; /* Times */
 
-  for(i = 0; i < 3; i++) cam->location[i] = location[i];
-  for(i = 0; i < 3; i++) cam->aim[i] = aim[i];
-  for(i = 0; i < 3; i++) cam->direction[i] = aim[i] - location[i];
+  if(pixels == NULL || zbuffer == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the image.\n");
+    return -1;
+  }
+  if(strchr(output, '%') != NULL && !framepattern(output)) {
+    fprintf(stderr, "Error: invalid name pattern %s (it needs a single %%d for the frame "
+            "number, as in frame%%04d.ppm, and %%%% for a %% sign).\n", output);
+    return -1;
+  }
+  if(strchr(output, '%') != NULL) /* One file per frame */
+    startrecorder(&images, format, NULL, false, output, width, height, true);
+  else {
+    file = strcmp(output, "-")?fopen(output, "w"):stdout;
+    if(file == NULL) {
+      fprintf(stderr, "Error: unable to open %s.\n", output);
+      return -1;
+    }
+    startrecorder(&images, format, file, false, NULL, width, height, true);
+  }
 
-  /* Normalise direction vector */
-  cam->distance = modulus(cam->direction);
-  if(cam->distance == 0)
-    cam->direction[0] = -1;
-  else
-    for(i = 0; i < 3; i++) cam->direction[i] /= cam->distance;
+  /* Frames are read once, so the ASCII data needs no cache */
+  if(!openbinary(&traj, mddata)) {
+    opentext(&traj.text, mddata, false);
+    traj.textend = telltext(&traj.text);
+  }
 
-  /* Screen axes */
-  cross(cam->direction, zenith, cam->screenx);
-  if(modulus(cam->screenx) == 0) cam->screenx[1] = 1;
-  cross(cam->screenx, cam->direction, cam->screeny);
+  setcamera(&cam, loc, aim, zen);
+  startraster(&rast, NULL, pixels, zbuffer, width, height, (samples > 1)?1:nthreads);
+  rast.occlusion = occlusion;
+  if(samples > 1) startsupersampler(&ss, &rast, samples, tent, nthreads);
+  proj.aggregate = (samples > 1)?0:aggregate; /* Samples are not merged */
+  traj.cutoff = cutoff;
+  startpipeline(&queue, &traj, queuedepth, nframe, step, false);
 
-  /* Resize screen axes */
-  r = modulus(cam->screenx);
-  for(i = 0; i < 3; i++) cam->screenx[i] /= r;
-  r = modulus(cam->screeny);
-  for(i = 0; i < 3; i++) cam->screeny[i] /= r;
+  t0 = tframe = seconds();
+  for(;;) {
+    if(!popframe(&queue, &frm, &k)) {
+      if(endpipeline(&queue)) break;
+      continue;
+    }
+    tstage = tframe;
+    st.wait = lap(&tstage);
+
+    /* Draw the frame and queue it for the image writer */
+    rast.fade = fade;
+    rast.backdrop = cam.distance;
+    if(samples > 1) { /* Clearing is part of drawing each band */
+      project(&frm, &cam, samples*width, samples*height, &proj);
+      st.project = lap(&tstage);
+      drawsupersampled(&ss, &proj, background, FAR_PLANE*cam.distance);
+    }
+    else {
+      clearraster(&rast, background, FAR_PLANE*cam.distance);
+      st.clear = lap(&tstage);
+      project(&frm, &cam, width, height, &proj);
+      st.project = lap(&tstage);
+      render(&rast, &proj);
+    }
+    st.draw = lap(&tstage);
+    recordframe(&images, &rast, k);
+    st.capture = lap(&tstage);
+    nframes++;
+
+    if(statsfile) { /* Frame profile */
+      st.frame = k;
+      st.particles = frm.n;
+      st.drawn = proj.n + proj.merged;
+      st.tested = rast.tested;
+      st.visible = rast.visible;
+      st.discs = rast.discs;
+      st.occluded = rast.occluded;
+      st.read = frm.readtime;
+      st.total = tstage - tframe;
+      writestats(statsfile, &st);
+    }
+    tframe = tstage;
+
+    /* Camera commands apply from the next frame, as on screen */
+    if(frm.newcamera) setcamera(&cam, frm.camera, frm.camera + 3, frm.camera + 6);
+  }
+  stoprecorder(&images);
+  t = seconds() - t0;
+
+  stoppipeline(&queue);
+  if(statsfile) fclose(statsfile);
+  if(file != NULL && file != stdout) fclose(file);
+  else fflush(stdout);
+  fprintf(stderr, "%d frames (%dx%d) in %.3f s: %.1f frames/s.\n",
+          nframes, width, height, t, (t > 0)?nframes/t:0);
+
+  free(pixels);
+  free(zbuffer);
+  return images.failed?-1:0;
 }
 
 /***** Main function *****/
 int main(int argc, char * argv[]) {
-  int i, j, k; /* Indices */
+  int i; /* Index */
   FILE * mddata = NULL; /* Pointer to data file */
-  FILE * videopipe = NULL; /* Pointer to named pipe for video output */
+  struct recorder video; /* Video recorder */
+  struct recorder shots; /* Screenshot writer */
 
   /* Default options */
   int background = BACKGROUND_COLOUR; /* Colour for background */
@@ -201,6 +4314,34 @@ int main(int argc, char * argv[]) {
   float aim[3] = {0, 0, 0}; /* Camera aim */
   float zen[3] = {0, 0, 1}; /* Camera zenith vector */
   int fade = 1; /* Fading flag */
+  int nframe = 0; /* Number of the next frame to display */
+  int width = WIDTH, height = HEIGHT; /* Window size in pixels */
+  bool cache = true; /* Binary frame cache flag */
+  int queuedepth = QUEUE_DEPTH; /* Number of frames read ahead */
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN); /* Number of drawing threads */
+  double benchmb = 0; /* Size of the parsing benchmark in megabytes */
+  int benchrepeats = 0; /* Repetitions of the drawing benchmark */
+  char * binaryfile = NULL; /* Output file for conversion */
+  bool int16 = false; /* Quantize positions in conversion */
+  bool delta = false; /* Delta-encode frames (conversion and cache) */
+  bool shm = true; /* Shared memory images flag */
+  bool benchx = false; /* Present benchmark images to X */
+  bool occlusion = false; /* Front to back drawing with occlusion culling */
+  float aggregate = 0; /* Particles per pixel above which sub-pixel ones are merged */
+  float fps = 0; /* Target playback rate (0 to draw every frame as it comes) */
+  float cutoff = 0; /* Distance below which particles are bonded (0 for none) */
+  bool follow = false; /* Follow live data */
+  char * output = NULL; /* Output of headless rendering */
+  int step = 1; /* Frames to advance in headless rendering */
+  int samples = 1; /* Samples per pixel across in headless rendering */
+  bool tent = false; /* Tent filter for the samples (box filter otherwise) */
+  FILE * statsfile = NULL; /* CSV file with the profile of every frame */
+  char * encoder = ENCODER; /* Video encoder */
+  char * system = NULL; /* Synthetic system to benchmark or generate */
+  long nparticles = 0; /* Particles in the synthetic system */
+  int ngenerate = 0; /* Frames of the synthetic trajectory */
+  char * generatefile = NULL; /* Output file for the synthetic trajectory */
+  float rmin = 0, rmax = 0; /* Radii in the synthetic system (default if rmax = 0) */
 
   /* Read command line arguments */
   if(argc < 2 && isatty(0)) { /* Use help message */
@@ -217,7 +4358,56 @@ int main(int argc, char * argv[]) {
            "  -L <x value>     Initial camera distance.\n"
            "  -l <x> <y> <z>   Initial location of camera.\n"
            "  -a <x> <y> <z>   Camera aim.\n"
-           "  -z <x> <y> <z>   Camera zenith vector.\n");
+           "  -z <x> <y> <z>   Camera zenith vector.\n"
+           "  -n <frame>       Initial frame.\n"
+           "  -W <pixels>      Window width (default %d).\n"
+           "  -H <pixels>      Window height (default %d).\n"
+           "  --no-cache       Do not cache parsed frames.\n"
+           "  --follow         Follow a running simulation (piped, or a growing\n"
+           "                   file), showing the newest frame.\n"
+           "  --queue <n>      Number of frames read ahead (default %d).\n"
+           "  --threads <n>    Number of drawing threads (default: one per core).\n"
+           "  --no-shm         Send images to X without shared memory.\n"
+           "  --fps <rate>     Play frames at a given rate, skipping frames\n"
+           "                   when drawing falls behind.\n"
+           "  --bonds <cutoff> Bond particles closer than the cutoff (in frames\n"
+           "                   without #%% bond commands).\n"
+           "  --occlusion      Draw front to back, skipping hidden particles.\n"
+           "  --aggregate <n>  Merge sub-pixel particles by pixel (average colour)\n"
+           "                   in frames with more than n particles per pixel.\n"
+           "  --encoder <program>  Video encoder: ffmpeg, avconv or raw\n"
+           "                   (video.raw file) (default %s).\n"
+           "  --headless <output>  Draw every frame without X into ppm files\n"
+           "                   (a name pattern like frame%%04d.ppm) or a single\n"
+           "                   stream of images (- for stdout), png if the\n"
+           "                   name ends in .png.\n"
+           "  --dump-frames <pattern> <n>  Save every n-th frame without X\n"
+           "                   (frame%%04d.ppm, or frame%%04d.png for png images).\n"
+           "  --supersample <n>  Draw n x n samples per pixel without X (for\n"
+           "                   smooth edges), averaged over each pixel.\n"
+           "  --tent           Filter the samples with a tent reaching the\n"
+           "                   neighbouring pixels (smoother than the average).\n"
+           "  --stats <file>   Write the time spent in each stage of every frame\n"
+           "                   to a CSV file.\n"
+           "  --bench-parse <MB>  Measure parsing speed on the data file\n"
+           "                   repeated up to the given size.\n"
+           "  --bench-raster <n>  Measure clearing and drawing time per pixel\n"
+           "                   on the first frame, repeated n times.\n"
+           "  --bench <system> <n>  Measure parse, raster and present times on\n"
+           "                   a synthetic system of n particles: lattice,\n"
+           "                   gas or droplet (no data file needed).\n"
+           "  --bench-x        Present benchmark images in an X window (instead\n"
+           "                   of encoding them as ppm images).\n"
+           "  --generate <system> <n> <frames> <file>\n"
+           "                   Write a synthetic trajectory (- for stdout).\n"
+           "  --radii <min> <max>  Uniform radius distribution in synthetic\n"
+           "                   systems.\n"
+           "  --convert <MD data file> <binary file>\n"
+           "                   Convert data file into a binary trajectory.\n"
+           "  --int16          Quantize positions to 16 bits when converting.\n"
+           "  --delta          Store most frames as differences from a keyframe\n"
+           "                   (when converting, and in the frame cache).\n",
+           WIDTH, HEIGHT, QUEUE_DEPTH, ENCODER);
     printf("Interaction keys:\n"
            "  (Arrow keys)     Rotate system.\n"
            "  +, -             Zoom in, out.\n"
@@ -228,10 +4418,12 @@ int main(int argc, char * argv[]) {
            "  1, 2             Look up, down.\n"
            "  3, 4             Camera roll counter-clockwise, clockwise.\n"
            "  b                Rewind data file.\n"
+           "  [, ]             Previous, next frame.\n"
            "  p, (space bar)   Toggle pause on/off.\n"
            "  .                Toggle fading on/off.\n"
            "  c                Output camera information.\n"
-           "  o                Take (ppm) screenshot.\n"
+           "  i                Show/hide frame profile.\n"
+           "  o                Take (binary ppm) screenshot.\n"
            "  0                Start/stop recording video.\n"
            "  q, (escape)      Quit program.\n");
     return 0;
@@ -241,6 +4433,94 @@ int main(int argc, char * argv[]) {
       /* Open md data file */
       if(argv[i][0] != '-')
         mddata = fopen(argv[i], "r");
+      /* Long options */
+      else if(!strcmp(argv[i], "--no-cache")) /* Disable frame cache */
+        cache = false;
+      else if(!strcmp(argv[i], "--follow")) /* Follow live data */
+        follow = true;
+      else if(!strcmp(argv[i], "--bench-parse")) { /* Parsing benchmark */
+        i++;
+        benchmb = atof(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--bench-raster")) { /* Drawing benchmark */
+        i++;
+        benchrepeats = atoi(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--bench")) { /* Synthetic benchmark */
+        system = argv[i + 1];
+        nparticles = atol(argv[i + 2]);
+        i += 2;
+      }
+      else if(!strcmp(argv[i], "--bench-x")) /* Benchmark presenting to X */
+        benchx = true;
+      else if(!strcmp(argv[i], "--generate")) { /* Synthetic trajectory */
+        system = argv[i + 1];
+        nparticles = atol(argv[i + 2]);
+        ngenerate = atoi(argv[i + 3]);
+        generatefile = argv[i + 4];
+        i += 4;
+      }
+      else if(!strcmp(argv[i], "--radii")) { /* Synthetic radius distribution */
+        rmin = atof(argv[i + 1]);
+        rmax = atof(argv[i + 2]);
+        i += 2;
+      }
+      else if(!strcmp(argv[i], "--convert")) { /* Binary conversion */
+        mddata = fopen(argv[i + 1], "r");
+        binaryfile = argv[i + 2];
+        i += 2;
+      }
+      else if(!strcmp(argv[i], "--int16")) /* Quantized positions */
+        int16 = true;
+      else if(!strcmp(argv[i], "--delta")) /* Delta-encoded frames */
+        delta = true;
+      else if(!strcmp(argv[i], "--queue")) { /* Frame queue depth */
+        i++;
+        queuedepth = atoi(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--threads")) { /* Drawing threads */
+        i++;
+        nthreads = atoi(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--no-shm")) /* Disable shared memory images */
+        shm = false;
+      else if(!strcmp(argv[i], "--fps")) { /* Target playback rate */
+        i++;
+        fps = atof(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--bonds")) { /* Automatic bonds */
+        i++;
+        cutoff = atof(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--occlusion")) /* Occlusion culling */
+        occlusion = true;
+      else if(!strcmp(argv[i], "--aggregate")) { /* Merge sub-pixel particles */
+        i++;
+        aggregate = atof(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--encoder")) { /* Video encoder */
+        i++;
+        encoder = argv[i];
+      }
+      else if(!strcmp(argv[i], "--headless")) { /* Render without X */
+        i++;
+        output = argv[i];
+      }
+      else if(!strcmp(argv[i], "--supersample")) { /* Samples per pixel across */
+        i++;
+        samples = atoi(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--tent")) /* Tent filter */
+        tent = true;
+      else if(!strcmp(argv[i], "--stats")) { /* Profile every frame */
+        i++;
+        statsfile = openstats(argv[i]);
+      }
+      else if(!strcmp(argv[i], "--dump-frames")) { /* Save every n-th frame */
+        output = argv[i + 1];
+        step = atoi(argv[i + 2]);
+        i += 2;
+      }
       /* Other options */
       else if(argv[i][1] == 'b') { /* Background colour */
         i++;
@@ -273,10 +4553,40 @@ int main(int argc, char * argv[]) {
         zen[2] = atof(argv[i + 3]);
         i += 3;
       }
+      else if(argv[i][1] == 'n') { /* Initial frame */
+        i++;
+        nframe = atoi(argv[i]);
+      }
+      else if(argv[i][1] == 'W') { /* Window width */
+        i++;
+        width = atoi(argv[i]);
+      }
+      else if(argv[i][1] == 'H') { /* Window height */
+        i++;
+        height = atoi(argv[i]);
+      }
       else i++; /* Skip unrecognised options */
     }
   }
-  if(!isatty(0)) { /* Open stdin */
+
+  if(width < 1 || height < 1) {
+    fprintf(stderr, "Error: invalid window size %dx%d.\n", width, height);
+    exit(-1);
+  }
+  if(samples < 1 || samples > 16) {
+    fprintf(stderr, "Error: invalid supersampling %d (1 to 16 samples across).\n", samples);
+    exit(-1);
+  }
+  if(rmin < 0 || rmin > rmax) {
+    fprintf(stderr, "Error: invalid radii %g to %g.\n", rmin, rmax);
+    exit(-1);
+  }
+  if(system && generatefile)
+    return generate(system, nparticles, ngenerate, rmin, rmax, generatefile);
+  if(system)
+    return benchmark(system, nparticles, rmin, rmax, width, height, nthreads, occlusion,
+                     aggregate, shm, benchx);
+  if(mddata == NULL && !isatty(0)) { /* Open stdin */
     mddata = stdin;
   }
 
@@ -285,6 +4595,18 @@ int main(int argc, char * argv[]) {
     return -1;
   }
 
+  if(benchmb > 0) return benchparse(mddata, benchmb);
+  if(binaryfile) return convert(mddata, binaryfile, int16, delta);
+  if(benchrepeats > 0) {
+    struct camera cam; /* Camera */
+    setcamera(&cam, loc, aim, zen);
+    return benchraster(mddata, &cam, width, height, benchrepeats);
+  }
+  if(output)
+    return headless(mddata, output, step, loc, aim, zen, background, fade, width, height,
+                    nthreads, occlusion, aggregate, cutoff, samples, tent, queuedepth, nframe,
+                    statsfile);
+
   /* Text message */
   fprintf(stderr, GREEN "  \xe2\x94\x8c" ULINE ULINE ULINE ULINE "\xe2\x94\x90\n"
                   "  \xe2\x94\x82" BLUE "sº" CYAN "o~" GREEN "\xe2\x94\x82  " WHITE "minipunto.\n"
@@ -293,185 +4615,202 @@ int main(int argc, char * argv[]) {
 
   /* Initialise X */
   Display *d = XOpenDisplay((char*)0);
-  Window w = XCreateSimpleWindow(d, DefaultRootWindow(d), 0, 0, WIDTH, HEIGHT, 5, 0, 0);
+  Window w = XCreateSimpleWindow(d, DefaultRootWindow(d), 0, 0, width, height, 5, 0, 0);
   XStoreName(d, w, "minipunto (v " VERSION ")"); /* Name in window bar */
   XEvent e;  /* X11 event */
   KeySym key; /* X11 KeySym code */
   XComposeStatus compose; /* Don't ask... */
-  XSelectInput(d, w, KeyPressMask); /* List of event types to recognise */
+  XSelectInput(d, w, KeyPressMask | StructureNotifyMask | ExposureMask); /* List of event types to recognise */
   GC g = XCreateGC(d, w, 0, 0); /* Graphics context */
   XWindowAttributes wa;
   XGetWindowAttributes(d, w, &wa);
-  char screenbuffer[4*WIDTH*HEIGHT];
-  XImage * I;
-  I = XCreateImage(d, DefaultVisual(d, 0), wa.depth, ZPixmap, 0, screenbuffer, 600, 600, 32, 0);
+  struct screen scr; /* Window images */
+  openscreen(&scr, d, w, g, wa.depth, width, height, shm);
   XMapRaised(d,w);
   XSetForeground(d, g, text);
 
   /* Data variables */
-  float dat[5]; /* Stream read from file (position -x, y and z-, radius and colour) */
-  char buffer[250]; /* String from data file */
-  char command[50]; /* Command in data file */
+  struct trajectory traj = {{mddata}}; /* Data file and frame index */
+  struct frame frm = {0}; /* Particle data in current frame */
+  struct pipeline queue; /* Frames read ahead by the reader thread */
+  int shown = 0; /* Number of the frame on screen */
+  bool newframe; /* A new frame has been read */
+  bool redraw = true; /* Draw the frame (again) */
+  bool repaint = false; /* Show the last image again */
+  float view[10] = {0}; /* Camera and fade flag of the last image */
+  bool seeking = false; /* Waiting for a frame after a seek */
+  bool due; /* The next frame is due (at the target rate) */
+  int previous; /* Number of the last frame shown */
+  int kplay = -1; /* Frame at which the playback clock started (-1 to restart it) */
+  double tplay = 0, tdue = 0; /* Start of the playback clock, time the next frame is due */
+  char buffer[250]; /* String from key press */
   char msg[250]; msg[0] = '\0'; /* On-screen message */
   bool paused = false; /* Paused flag */
   bool recording = false; /* Recording to video flag */
   bool screenshot = false; /* Screenshot flag */
+  bool shooting = false; /* Screenshot writer started */
+  bool hud = false; /* Show the frame profile */
+  struct stats st = {0}, last = {0}; /* Profile of the current and last frames */
+  double tframe, tstage; /* End of the last frame, end of the last stage */
   int nscreenshot = 0; /* Screenshot number */
-  long filepos = ftell(mddata); /* Position in a stream */
+
+  /* Binary trajectory, or ASCII data and binary frame cache */
+  if(!openbinary(&traj, mddata)) {
+    opentext(&traj.text, mddata, follow);
+    traj.textend = telltext(&traj.text);
+    if(cache) {
+      traj.cache = tmpfile();
+      traj.delta = delta;
+      if(traj.cache == NULL)
+        fprintf(stderr, "Warning: unable to create frame cache.\n");
+    }
+  }
 
   /* 3D variables */
   struct camera cam; /* Camera */
-  float r[3]; /* Camera-particle displacement vector */
-  float R; /* Radius */
-  struct colour c; /* RGB colour */
-  float depth = 0; /* Depth of point from camera */
-  int xs, ys, s; /* Screen coordinates of particle */
-  float zbuffer[WIDTH*HEIGHT]; /* Pixel depth z-buffer */
+  struct projection proj = {0}; /* Particles projected on the screen */
+  struct raster rast; /* Rasteriser */
+  float * zbuffer = alignedalloc(width*height*sizeof(float)); /* Pixel depth z-buffer */
   float backdrop = 2.5f*L; /* Maximum allowed depth */
 
   /* Set the camera position and orientation */
   setcamera(&cam, loc, aim, zen);
 
+  /* Start the drawing threads */
+  if(zbuffer == NULL) {
+    fprintf(stderr, "Error: unable to allocate memory for the z-buffer.\n");
+    exit(-1);
+  }
+  startraster(&rast, scr.image[scr.back], NULL, zbuffer, width, height, nthreads);
+  rast.occlusion = occlusion;
+  proj.aggregate = aggregate;
+
+  /* Start reading frames */
+  traj.cutoff = cutoff;
+  startpipeline(&queue, &traj, queuedepth, nframe, 1, true);
+
   /* Main loop (read data, events and refresh frame) */
+  tframe = seconds();
   while(1) {
-    if(!fgets(buffer, 250, mddata)) { /* Read a line from file */
-      rewind(mddata); /* Check the case of stdin */
-    }
-
-    /* Default radius and colour */
-    R = 1; c = (struct colour) {250, 250, 250};
-
-    /* Read string with sscanf */
-    s=sscanf(buffer, "%f %f %f %f %f", &dat[0], &dat[1], &dat[2], &dat[3], &dat[4]);
-
-    if(s > 2) { /* Enough data to draw a particle */
-      /* Get particle data */
-      if(s > 3) R = dat[3];
-
-      /* Colour RGB components */
-      if(s > 4) {
-        c.r = ((int) dat[4])/65536;
-        c.g = (((int) dat[4])/256)%256;
-        c.b = ((int) dat[4])%256;
-      }
-
-      /* Camera-particle vector */
-      for(i = 0; i < 3; i++) r[i] = dat[i] - cam.location[i];
-
-      /* Depth of particle measured from camera */
-      depth = dot(r, cam.direction)/3.732;
-
-      if(depth > 1) {
-        /* Screen coordinates of particle */
-        xs=(int)(0.5f*WIDTH*(1 + dot(r, cam.screenx)/depth));
-        ys=(int)(0.5f*HEIGHT*(1 - dot(r, cam.screeny)/depth));
-        s=(int)(0.5f*WIDTH*R/depth);
-        // # pragma omp parallel for private(j)
-        for(i=-s; i <= s; i++) {
-          for(j = -s; j <= s; j++) {
-            /* Only paint points on a circle */
-            if(i*i + j*j > s*s) continue;
-
-            /* Light angle factor */
-            # ifdef FAST_MATH
-            float lighting = s?1.0f - (i*i + j*j)/(2.0f*s*s):1.0f;
-            # else
-            float lighting = s?sqrtf(1.0f - (float) (i*i + j*j)/(s*s)):1.0f;
-            # endif
-            if(lighting > 1) lighting = 1.0f;
-
-            if(abs(xs + i - WIDTH/2) < WIDTH/2 && abs(ys + j - HEIGHT/2) < HEIGHT/2) {
-              if(zbuffer[WIDTH*(xs + i)+(ys + j)] > depth - lighting) { /* Check whether point is visible */
-                zbuffer[WIDTH*(xs + i)+(ys + j)] = depth - lighting;
-                # ifndef NO_FADING
-                lighting *= (1.0f - fade*(depth - 1.0f)/(0.5f*backdrop - 1.0f)); /* Modify colour by depth */
-                # endif
-                if(lighting < 0.0f) lighting = 0.0f;
-                XPutPixel(I, xs + i, ys + j, (int) (c.r*lighting)*65536 + (int) (c.g*lighting)*256 + (int) (c.b*lighting)); /* Draw point */
-              }
-            }
-          }
-        }
-      }
+    /* Take the next frame from the reader thread (stay on this frame if paused) */
+    /* At the target rate, wait until the next frame is due and skip the
+       frames that are already late */
+    due = true;
+    if(fps > 0 && !paused && !seeking && kplay >= 0) {
+      tdue = tplay + (shown + 1 - kplay)/fps;
+      due = seconds() >= tdue;
+      if(due) skippipeline(&queue, shown, kplay + (int) ((seconds() - tplay)*fps));
     }
-    else if(buffer[0]=='#') { /* Ignore comments */
-      if(buffer[1]=='%') { /* Magic commands */
-        s = sscanf(buffer, "#%% %s", command);
-        if(!strcmp(command,"camera")) {
-          s = sscanf(buffer, "#%% camera %f %f %f %f %f %f %f %f %f",
-                             &loc[0], &loc[1], &loc[2],
-                             &aim[0], &aim[1], &aim[2],
-                             &zen[0], &zen[1], &zen[2]);
-        }
-      }
-      else if(buffer[1]=='\'') { /* Print text */
-        s = sscanf(buffer, "#' %250[^\n]", msg);
+    previous = shown;
+    newframe = (!paused || seeking) && due && popframe(&queue, &frm, &shown);
+    if(newframe) {
+      /* Restart the playback clock after a pause, seek or loop */
+      if(kplay < 0 || seeking || shown < previous) {
+        kplay = shown;
+        tplay = seconds();
       }
+      st.skipped = (shown > previous && !seeking)?shown - previous - 1:0;
+      seeking = false;
     }
-    else // if(buffer[0]=='\n') /* If line is blank, then draw frame */
-    {
-      XPutImage(d, w, g, I, 0, 0, 0, 0, 600, 600); /* Display frame */
-      XDrawString(d, w, g, 2, 12, msg, strlen(msg)); /* Display messages */
-      if(recording) XDrawString(d, w, g, WIDTH-45, 15, "[0 REC]", 7);
-      XFlush(d); /* Refresh screen */
-      usleep(30); /* Sleep for 30 microseconds */
 
-      if(paused) fseek(mddata, filepos, SEEK_SET); /* Stay on this frame */
-      else filepos = ftell(mddata); /* Store position of next frame */
+    /* Draw new frames, and the paused frame only if the view has changed */
+    redraw = redraw || newframe || (paused && setview(view, loc, aim, zen, fade));
+    if(redraw) {
+      tstage = tframe;
+      st.wait = lap(&tstage);
+      st.frame = shown;
+      st.particles = frm.n;
+      st.read = newframe?frm.readtime:0;
+      if(!newframe) st.skipped = 0;
+      st.playback = (shown > kplay)?(shown - kplay)/(tstage - tplay):0;
 
-      setcamera(&cam, loc, aim, zen); /* Reset the camera position */
+      /* Clear the next image and z-buffer (once X has read it) */
+      setview(view, loc, aim, zen, fade);
+      setcamera(&cam, loc, aim, zen);
+      setimage(&rast, nextimage(&scr));
+      st.present = lap(&tstage); /* Waiting for X to read the image */
+      backdrop = cam.distance;
+      clearraster(&rast, background, FAR_PLANE*backdrop);
+      st.clear = lap(&tstage);
 
-      if(screenshot) { /* Take screenshot */
-        char * screenshot_filename; /* String to store number */
-        s = asprintf(&screenshot_filename, "%d.ppm", nscreenshot);
+      /* Project and draw particles. A large frame that stays on screen is
+         put in a grid, to skip the cells out of view as the camera moves. */
+      if(newframe) proj.grid.n = 0;
+      else if(proj.grid.n != frm.n) buildgrid(&proj.grid, &frm);
+      project(&frm, &cam, rast.width, rast.height, &proj);
+      st.project = lap(&tstage);
+      rast.fade = fade;
+      rast.backdrop = backdrop;
+      render(&rast, &proj);
+      st.draw = lap(&tstage);
+      st.drawn = proj.n + proj.merged;
+      st.tested = rast.tested;
+      st.visible = rast.visible;
+      st.discs = rast.discs;
+      st.occluded = rast.occluded;
 
-        /* Open screenshot file */
-        FILE * screenshot_file;
-        screenshot_file = fopen((char *) screenshot_filename, "w");
+      /* Magic commands and messages in the frame */
+      if(frm.newmsg) strcpy(msg, frm.msg);
+      if(frm.newcamera) {
+        for(i = 0; i < 3; i++) loc[i] = frm.camera[i];
+        for(i = 0; i < 3; i++) aim[i] = frm.camera[3 + i];
+        for(i = 0; i < 3; i++) zen[i] = frm.camera[6 + i];
+      }
+    }
 
-        /* Output image */
-        fprintf(screenshot_file, "P3\n"); /* Magic number */
-        fprintf(screenshot_file, "%d %d\n", WIDTH, HEIGHT);
-        fprintf(screenshot_file, "255\n"); /* Colour depth */
-        for(j = 0; j < HEIGHT; j++) {
-          for(i = 0; i < WIDTH; i++) {
-            s = XGetPixel(I, i, j);
-            fprintf(screenshot_file, "%d %d %d\n", s/65536, (s/256)%256, s%256);
-          }
-        }
+    /* Display the image (again if the window needs it) */
+    if(redraw || repaint) {
+      updateimage(&rast);
+      showimage(&scr);
+      XDrawString(d, w, g, 2, 12, msg, strlen(msg)); /* Display messages */
+      if(recording) XDrawString(d, w, g, rast.width - 45, 15, "[0 REC]", 7);
+      if(hud) drawstats(&scr, &last, fps); /* Profile of the last frame */
+      XFlush(d); /* Refresh screen */
+      st.present += lap(&tstage);
+      usleep(30); /* Sleep for 30 microseconds */
+    }
 
-        fclose(screenshot_file); /* Close file */
-        nscreenshot++; /* Advance screenshot number */
-        screenshot = false; /* Reset screenshot flag */
-      }
+    if(screenshot) { /* Take screenshot (written by a separate thread) */
+      if(!shooting)
+        startrecorder(&shots, OUTPUT_PPM, NULL, false, "%d.ppm", rast.width, rast.height, true);
+      shooting = true;
+      recordframe(&shots, &rast, nscreenshot);
+      nscreenshot++; /* Advance screenshot number */
+      screenshot = false; /* Reset screenshot flag */
+    }
 
-      if(recording) { /* Add frame to video */
-        /* Output raw pixel data to named pipe */
-        for(j = 0; j < HEIGHT; j++) {
-          for(i = 0; i < WIDTH; i++) {
-            s = XGetPixel(I, i, j);
-            fwrite(&s, sizeof(int), 1, videopipe);
-          }
-        }
-      }
+    /* Add the frame to the video (and, while paused, repeat it as the video goes on) */
+    if(recording && (redraw || paused)) recordframe(&video, &rast, 0);
 
-      /* Clear the window and z-buffer to start drawing the next frame */
-      for(i = 0; i < WIDTH; i++) {
-        for(j = 0; j < HEIGHT; j++) {
-          BACKGROUND_HORIZON
-          XPutPixel(I, i, j, background);
-          backdrop = 0;
-          for(k = 0; k < 3; k++)
-            backdrop += (cam.aim[k] - cam.location[k])*(cam.aim[k] - cam.location[k]);
-          backdrop = sqrtf(backdrop);
-          zbuffer[WIDTH*i + j] = 2.5f*backdrop;
-        }
+    if(redraw) { /* Frame profile */
+      st.capture = lap(&tstage);
+      st.total = tstage - tframe;
+      tframe = tstage;
+      if(statsfile) writestats(statsfile, &st);
+      last = st;
+    }
+    else if(!seeking && !repaint && XPending(d) == 0) {
+      /* Nothing to draw: sleep until an X event arrives, or the next frame
+         (or video frame, while paused) is due */
+      if(paused) {
+        waitevent(d, recording?1.0/30:-1);
+        tframe = seconds();
       }
+      else if(!due) waitevent(d, fmax(tdue - seconds(), 0));
     }
+    redraw = repaint = false;
+
     while(XPending(d)>0) {
       XNextEvent(d, &e);
+      imagedone(&scr, &e);
+      if(e.type == ConfigureNotify) { /* Window resized */
+        width = e.xconfigure.width;
+        height = e.xconfigure.height;
+      }
+      if(e.type == Expose && e.xexpose.count == 0) /* Window uncovered */
+        repaint = true;
       if(e.type==KeyPress){
-        s = XLookupString(&e.xkey, buffer, 250, &key, &compose);
+        XLookupString(&e.xkey, buffer, 250, &key, &compose);
         switch(key)
         {
           case KEY_PLUS: /* Zoom in */
@@ -572,14 +4911,24 @@ int main(int argc, char * argv[]) {
           /* Rewind MD data file */
           case KEY_B:
           case KEY_b:
-            rewind(mddata); /* Check the case of stdin */
-            filepos = ftell(mddata); /* Position in a stream */
+            seekpipeline(&queue, 0);
+            seeking = true;
+            break;
+          /* Step through frames */
+          case KEY_LBRACKET:
+            seekpipeline(&queue, (shown > 0)?shown - 1:-1);
+            seeking = true;
+            break;
+          case KEY_RBRACKET:
+            seekpipeline(&queue, shown + 1);
+            seeking = true;
             break;
           /* Pause */
           case KEY_P:
           case KEY_p:
           case KEY_SPC:
             paused = 1 - paused;
+            kplay = -1;
             break;
           case KEY_C:
           case KEY_c:
@@ -591,60 +4940,67 @@ int main(int argc, char * argv[]) {
           case XK_period:
             fade = 1 - fade;
             break;
+          case KEY_I:
+          case KEY_i:
+            hud = 1 - hud;
+            repaint = true;
+            break;
           case KEY_O:
           case KEY_o:
             screenshot = true;
             break;
           case KEY_0:
             recording = 1 - recording;
-            if(recording) {
-              # ifdef RAW_VIDEO_TO_FILE
-              /* Open video file */
-              videopipe = fopen("video.raw", "w");
-              # else
-              char pipecommand[120];
-              sprintf(pipecommand,
-                      "cat | avconv -loglevel panic -y -f rawvideo -s %dx%d -pix_fmt rgb32"
-                      " -r 30 -i - -an -b:v 24000k video.mp4", WIDTH, HEIGHT);
-              /* Open pipe */
-              videopipe = popen(pipecommand, "w");
-              # endif
-              fprintf(stderr, "Recording video...\n");
-              if(videopipe == NULL) {
-                fprintf(stderr, "Error: unable to open video pipe.\n");
-                exit(-1);
-              }
-            }
-            else
-            {
-              fprintf(stderr, "Recording stopped.\n");
-              /* Close pipe */
-              # ifdef RAW_VIDEO_TO_FILE
-              fclose(videopipe);
-              # else
-              pclose(videopipe);
-              # endif
-              videopipe = NULL;
-            }
+            if(recording) startvideo(&video, encoder, rast.width, rast.height);
+            else stopvideo(&video);
+            repaint = true;
             break;
           /* Close X and exit */
           case KEY_ESC:
           case KEY_Q:
           case KEY_q:
+          stoppipeline(&queue);
+          closescreen(&scr);
+          free(zbuffer);
           XFreeGC(d, g);
           XDestroyWindow(d,w);
           XCloseDisplay(d);
 
           /* Close files */
           fclose(mddata);
-          # ifdef RAW_VIDEO_TO_FILE
-          if(videopipe != NULL) fclose(videopipe);
-          # else
-          if(videopipe != NULL) pclose(videopipe);
-          # endif
+          if(traj.cache != NULL) fclose(traj.cache);
+          if(recording) stopvideo(&video);
+          if(shooting) stoprecorder(&shots);
+          if(statsfile) fclose(statsfile);
+          if(fps > 0 && shown > kplay && kplay >= 0)
+            fprintf(stderr, "Played %.1f frames/s (target %g).\n",
+                    (shown - kplay)/(seconds() - tplay), fps);
           return 0;
         }
       }
     }
+
+    /* Resize the images and z-buffer to the window (once the events are read) */
+    if(width != rast.width || height != rast.height) {
+      if(recording) { /* The video has a fixed size */
+        fprintf(stderr, "Window resized.\n");
+        stopvideo(&video);
+        recording = false;
+      }
+      if(shooting) { /* Screenshots of the new size */
+        stoprecorder(&shots);
+        shooting = false;
+      }
+      closescreen(&scr);
+      openscreen(&scr, d, w, g, wa.depth, width, height, shm);
+      free(zbuffer);
+      zbuffer = alignedalloc(width*height*sizeof(float));
+      if(zbuffer == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for the z-buffer.\n");
+        exit(-1);
+      }
+      resizeraster(&rast, scr.image[scr.back], NULL, zbuffer, width, height);
+      redraw = true;
+    }
   }
 }